@@ -23,6 +23,14 @@
 
 #include "inspircd.h"
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif
+
 enum
 {
 	ERR_INVALIDMODEPARAM = 696
@@ -52,6 +60,57 @@ class AntiCapsSettings
 	}
 };
 
+/** The number of bytes to count between early exit checks. */
+static const size_t BLOCK_SIZE = 64;
+
+/** Counts the ASCII upper and lower case letters in a block of text.
+ * Uses SSE2 or AVX2 if available to classify 16 or 32 bytes at a time.
+ */
+static void CountASCIICase(const unsigned char* data, size_t length, size_t& upper, size_t& lower)
+{
+	size_t pos = 0;
+
+	// Bytes above 0x7F are negative when compared as signed so they are never in range.
+#ifdef __AVX2__
+	const __m256i upperlow32 = _mm256_set1_epi8('A' - 1);
+	const __m256i upperhigh32 = _mm256_set1_epi8('Z' + 1);
+	const __m256i lowerlow32 = _mm256_set1_epi8('a' - 1);
+	const __m256i lowerhigh32 = _mm256_set1_epi8('z' + 1);
+	for (; pos + 32 <= length; pos += 32)
+	{
+		const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+		const __m256i isupper = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, upperlow32), _mm256_cmpgt_epi8(upperhigh32, chunk));
+		const __m256i islower = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, lowerlow32), _mm256_cmpgt_epi8(lowerhigh32, chunk));
+		upper += __builtin_popcount(static_cast<unsigned int>(_mm256_movemask_epi8(isupper)));
+		lower += __builtin_popcount(static_cast<unsigned int>(_mm256_movemask_epi8(islower)));
+	}
+#endif
+
+#ifdef __SSE2__
+	const __m128i upperlow16 = _mm_set1_epi8('A' - 1);
+	const __m128i upperhigh16 = _mm_set1_epi8('Z' + 1);
+	const __m128i lowerlow16 = _mm_set1_epi8('a' - 1);
+	const __m128i lowerhigh16 = _mm_set1_epi8('z' + 1);
+	for (; pos + 16 <= length; pos += 16)
+	{
+		const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+		const __m128i isupper = _mm_and_si128(_mm_cmpgt_epi8(chunk, upperlow16), _mm_cmplt_epi8(chunk, upperhigh16));
+		const __m128i islower = _mm_and_si128(_mm_cmpgt_epi8(chunk, lowerlow16), _mm_cmplt_epi8(chunk, lowerhigh16));
+		upper += __builtin_popcount(static_cast<unsigned int>(_mm_movemask_epi8(isupper)));
+		lower += __builtin_popcount(static_cast<unsigned int>(_mm_movemask_epi8(islower)));
+	}
+#endif
+
+	for (; pos < length; ++pos)
+	{
+		const unsigned char chr = data[pos];
+		if (static_cast<unsigned char>(chr - 'A') < 26)
+			upper += 1;
+		else if (static_cast<unsigned char>(chr - 'a') < 26)
+			lower += 1;
+	}
+}
+
 class AntiCapsMode : public ModeHandler
 {
  private:
@@ -151,10 +210,65 @@ class ModuleAntiCaps : public Module
 {
  private:
 	SimpleExtItem<AntiCapsSettings> ext;
-	std::bitset<UCHAR_MAX> uppercase;
-	std::bitset<UCHAR_MAX> lowercase;
+	std::bitset<UCHAR_MAX + 1> uppercase;
+	std::bitset<UCHAR_MAX + 1> lowercase;
+	bool asciicase;
+	bool earlyexit;
 	AntiCapsMode mode;
 
+	void CountCase(const unsigned char* data, size_t length, size_t& upper, size_t& lower)
+	{
+		// The default character sets can be counted without the tables.
+		if (asciicase)
+		{
+			CountASCIICase(data, length, upper, lower);
+			return;
+		}
+
+		for (size_t pos = 0; pos < length; ++pos)
+		{
+			if (uppercase.test(data[pos]))
+				upper += 1;
+			else if (lowercase.test(data[pos]))
+				lower += 1;
+		}
+	}
+
+	bool ExceedsThreshold(const unsigned char* data, size_t length, unsigned int threshold)
+	{
+		size_t upper = 0;
+		size_t lower = 0;
+		for (size_t pos = 0; pos < length; )
+		{
+			const size_t block = std::min(length - pos, BLOCK_SIZE);
+			CountCase(data + pos, block, upper, lower);
+			pos += block;
+
+			if (!earlyexit || pos >= length)
+				continue;
+
+			// Stop if the rest of the message can't change the outcome. If
+			// the rest was all lower case and the threshold would still be
+			// reached, or if it was all upper case and the threshold would
+			// still not be reached, then counting it is pointless.
+			const size_t remaining = length - pos;
+			const size_t maxletters = upper + lower + remaining;
+			if ((upper * 100) / maxletters >= threshold)
+				return true;
+			if (((upper + remaining) * 100) / maxletters < threshold)
+				return false;
+		}
+
+		// If the message was entirely symbols then the message
+		// can't contain any upper case letters.
+		const size_t letters = upper + lower;
+		if (letters == 0)
+			return false;
+
+		// Calculate the percentage.
+		return (upper * 100) / letters >= threshold;
+	}
+
 	void CreateBan(Channel* channel, User* user, bool mute)
 	{
 		std::string banmask(mute ? "m:" : "");
@@ -176,6 +290,8 @@ class ModuleAntiCaps : public Module
  public:
 	ModuleAntiCaps()
 		: ext("anticaps", this)
+		, asciicase(true)
+		, earlyexit(true)
 		, mode(this, ext)
 	{
 	}
@@ -202,6 +318,18 @@ class ModuleAntiCaps : public Module
 		const std::string lower = tag->getString("lowercase", "abcdefghijklmnopqrstuvwxyz");
 		for (std::string::const_iterator iter = lower.begin(); iter != lower.end(); ++iter)
 			lowercase.set(static_cast<unsigned char>(*iter));
+
+		asciicase = true;
+		for (size_t chr = 0; chr <= UCHAR_MAX; ++chr)
+		{
+			if (uppercase.test(chr) != (chr >= 'A' && chr <= 'Z') || lowercase.test(chr) != (chr >= 'a' && chr <= 'z'))
+			{
+				asciicase = false;
+				break;
+			}
+		}
+
+		earlyexit = tag->getBool("earlyexit", true);
 	}
 
 	ModResult OnUserPreMessage(User* user, void* dest, int target_type, std::string& text, char, CUList&)
@@ -227,8 +355,8 @@ class ModuleAntiCaps : public Module
 
 		// If the message is a CTCP then we skip it unless it is
 		// an ACTION in which case we skip the prefix and suffix.
-		std::string::const_iterator text_begin = text.begin();
-		std::string::const_iterator text_end = text.end();
+		size_t text_begin = 0;
+		size_t text_end = text.length();
 		if (text[0] == '\1')
 		{
 			// If the CTCP is not an action then skip it.
@@ -249,30 +377,14 @@ class ModuleAntiCaps : public Module
 
 		// If the message is shorter than the minimum length then
 		// we don't need to do anything else.
-		size_t length = std::distance(text_begin, text_end);
+		const size_t length = text_end > text_begin ? text_end - text_begin : 0;
 		if (length < config->minlen)
 			return MOD_RES_PASSTHRU;
 
-		// Count the characters to see how many upper case and
-		// ignored (non upper or lower) characters there are.
-		size_t upper = 0;
-		for (std::string::const_iterator iter = text_begin; iter != text_end; ++iter)
-		{
-			unsigned char chr = static_cast<unsigned char>(*iter);
-			if (uppercase.test(chr))
-				upper += 1;
-			else if (!lowercase.test(chr))
-				length -= 1;
-		}
-
-		// If the message was entirely symbols then the message
-		// can't contain any upper case letters.
-		if (length == 0)
-			return MOD_RES_PASSTHRU;
-
-		// Calculate the percentage.
-		double percent = round((upper * 100) / length);
-		if (percent < config->percent)
+		// Count the upper and lower case characters to see whether
+		// the message is over the threshold.
+		const unsigned char* data = reinterpret_cast<const unsigned char*>(text.data()) + text_begin;
+		if (!ExceedsThreshold(data, length, config->percent))
 			return MOD_RES_PASSTHRU;
 
 		char message[MAXBUF];
@@ -15,48 +15,119 @@
 
 #include "inspircd.h"
 
+/** The rank of the user who set each entry in a list mode. */
+typedef nspace::hash_map<std::string, unsigned int> RankIndex;
+
 class Banprotector
 {
  public:
-	std::map<char, std::map<std::string, unsigned int>> banrank;
+	std::map<char, RankIndex> banrank;
 	Banprotector() {}
 
 	void addrank(const char& modeparam, const std::string& banparam, const unsigned int& rank)
 	{
-		std::map<char, std::map<std::string, unsigned int>>::iterator obindex = banrank.find(modeparam);
-		if (obindex != banrank.end()) {
-			std::map<std::string, unsigned int> innerban = obindex->second;
-			std::map<std::string, unsigned int>::iterator ibindex = innerban.find(banparam);
-			if (ibindex != innerban.end())
-				return;
+		// If the entry already exists then keep the rank of whoever set it first.
+		banrank[modeparam].insert(std::make_pair(banparam, rank));
+	}
+
+	bool checkrank(const char& modeparam, const std::string& banparam, const unsigned int& rank) const
+	{
+		std::map<char, RankIndex>::const_iterator obindex = banrank.find(modeparam);
+		if (obindex == banrank.end())
+			return true;
+
+		RankIndex::const_iterator ibindex = obindex->second.find(banparam);
+		if (ibindex == obindex->second.end())
+			return true;
+
+		return ibindex->second <= rank;
+	}
+
+	void delrank(const char& modeparam, const std::string& banparam)
+	{
+		std::map<char, RankIndex>::iterator obindex = banrank.find(modeparam);
+		if (obindex == banrank.end())
+			return;
+
+		obindex->second.erase(banparam);
+		if (obindex->second.empty())
+			banrank.erase(obindex);
+	}
+};
+
+/** Stores the ranks on the channel and sends them to other servers when linking so
+ * entries which were set before a netsplit are still protected after it.
+ */
+class BanprotectorExt : public ExtensionItem
+{
+ public:
+	BanprotectorExt(Module* Creator)
+		: ExtensionItem("Banprotector", Creator)
+	{
+	}
+
+	void free(void* item)
+	{
+		delete static_cast<Banprotector*>(item);
+	}
+
+	Banprotector* get(const Extensible* container) const
+	{
+		return static_cast<Banprotector*>(get_raw(container));
+	}
+
+	Banprotector* getOrCreate(Extensible* container)
+	{
+		Banprotector* banp = get(container);
+		if (!banp)
+		{
+			banp = new Banprotector();
+			set_raw(container, banp);
 		}
-		banrank[modeparam][banparam] = rank;
+		return banp;
 	}
 
-	bool checkrank(const char& modeparam, const std::string& banparam, const unsigned int& rank)
+	std::string serialize(SerializeFormat format, const Extensible* container, void* item) const
 	{
-		std::map<char, std::map<std::string, unsigned int>>::iterator obindex = banrank.find(modeparam);
-		if (obindex != banrank.end()) {
-			std::map<std::string, unsigned int> innerban = obindex->second;
-			std::map<std::string, unsigned int>::iterator ibindex = innerban.find(banparam);
-			if (ibindex == innerban.end())
-				return true;
-			if (ibindex->second > rank)
-				return false;
+		Banprotector* banp = static_cast<Banprotector*>(item);
+		if (!banp)
+			return "";
+
+		// Each entry is sent as <mode>:<rank>:<entry>.
+		std::string buffer;
+		for (std::map<char, RankIndex>::const_iterator obindex = banp->banrank.begin(); obindex != banp->banrank.end(); ++obindex)
+		{
+			for (RankIndex::const_iterator ibindex = obindex->second.begin(); ibindex != obindex->second.end(); ++ibindex)
+			{
+				if (!buffer.empty())
+					buffer.push_back(' ');
+				buffer.push_back(obindex->first);
+				buffer.push_back(':');
+				buffer.append(ConvToStr(ibindex->second));
+				buffer.push_back(':');
+				buffer.append(ibindex->first);
+			}
 		}
-		return true;
+		return buffer;
 	}
 
-	void delrank(const char& modeparam, const std::string& banparam)
+	void unserialize(SerializeFormat format, Extensible* container, const std::string& value)
 	{
-		std::map<char, std::map<std::string, unsigned int>>::iterator obindex = banrank.find(modeparam);;
-		if (obindex != banrank.end()) {
-			std::map<std::string, unsigned int> innerban = obindex->second;
-			std::map<std::string, unsigned int>::iterator removeindex = innerban.find(banparam);
-			if (removeindex != innerban.end())
+		Banprotector* banp = getOrCreate(container);
+		irc::spacesepstream entrystream(value);
+		for (std::string entry; entrystream.GetToken(entry); )
+		{
+			std::string::size_type sep = entry.find(':', 2);
+			if (entry.length() < 4 || entry[1] != ':' || sep == std::string::npos || sep + 1 >= entry.length())
+				continue;
+
+			// When merging after a netsplit keep the highest rank for each entry.
+			const unsigned int rank = ConvToInt(entry.substr(2, sep - 2));
+			const std::string banparam = entry.substr(sep + 1);
+			if (banp->checkrank(entry[0], banparam, rank))
 			{
-				innerban.erase(removeindex);
-				banrank[modeparam] = innerban;
+				banp->delrank(entry[0], banparam);
+				banp->addrank(entry[0], banparam, rank);
 			}
 		}
 	}
@@ -65,10 +136,10 @@ class Banprotector
 class ModuleBanprotect : public Module
 {
  private:
-	SimpleExtItem<Banprotector> ext;
+	BanprotectorExt ext;
  public:
 	ModuleBanprotect()
-		: ext("Banprotector", this)
+		: ext(this)
 	{
 	}
 
@@ -95,13 +166,8 @@ class ModuleBanprotect : public Module
 		if (!mh->IsListMode() || mh->GetPrefixRank() > 0)
 			return MOD_RES_PASSTHRU;
 
-		Banprotector* banp = ext.get(chan);
-		if (!banp)
-		{
-			ext.set(chan, new Banprotector());
-			banp = ext.get(chan);
-		}
-		
+		Banprotector* banp = ext.getOrCreate(chan);
+
 		Membership* transmitter = chan->GetUser(user);
 		if (!transmitter)
 		{
@@ -1,7 +1,6 @@
-#include	<iostream>
-#include	<sstream>
 #include	<string>
 #include "inspircd.h"
+#include "threadengine.h"
 #include "u_listmode.h"
 
 ///	\todo	function calls should be replaced with the new versions
@@ -30,12 +29,20 @@
  *		<module name="m_inviteldapexception.so">
  *		<inviteldapexception
  *			server="ldap.example.com"
+ *			port="389"
  *			base="ou=Group,dc=example,dc=com"
- *			attributes="=member,=uniqueMember,memberUid">
+ *			attributes="=member,=uniqueMember,memberUid"
+ *			timeout="5"
+ *			cachetime="300">
  *
  *	The 'attributes' tag lists attributes to check to decide if the user
  *	is member of the group or not. If it begins with '=', the modules
  *	will look for attrib:...=username, otherwise attrib:username
+ *
+ *	Lookups are done by a worker thread which keeps its connection to the
+ *	LDAP server open between lookups. A join which needs a lookup is held
+ *	back until the answer arrives and is then retried. Answers are cached
+ *	for 'cachetime' seconds. Failed lookups are only cached for a few seconds.
  */
 
 /** Handles channel mode +U
@@ -46,24 +53,63 @@ class InviteLdapException : public ListModeBase
 	InviteLdapException(Module* Creator) : ListModeBase(Creator, "ldapex", 'U', "End of Channel LDAP Group Invite Exception List", 350, 351, false) { }
 };
 
-class ModuleInviteLdapException : public Module
+/** The maximum depth of nested groups which will be followed.
+ */
+#define MAX_GROUP_DEPTH 8
+
+/** How long a failed lookup is cached for.
+ */
+#define ERROR_CACHE_TIME 10
+
+/** How much longer than the LDAP timeout a join is held back for.
+ */
+#define DEFERRED_JOIN_GRACE 5
+
+/** The LDAP server settings used by the worker thread.
+ */
+struct LDAPSettings
 {
-	InviteLdapException ie;
-	std::string         ldapserver;
-public:
-	ModuleInviteLdapException() : ie(this)
-	{
-		if (!ServerInstance->Modes->AddMode(&ie))
-			throw ModuleException("Could not add new modes!");
+	std::string server;
+	int port;
+	std::string base;
+	std::vector<std::string> attributes;
+	int timeout;
+};
 
-		ie.DoImplements(this);
-		Implementation eventlist[] = { I_On005Numeric, I_OnCheckInvite, I_OnCheckKey };
-		ServerInstance->Modules->Attach(eventlist, this, 3);
+/** A group membership lookup. Filled in by the worker thread.
+ */
+struct LDAPLookup
+{
+	std::string user;
+	std::string group;
+	bool member;
+	std::string error;
+
+	LDAPLookup(const std::string& User, const std::string& Group)
+		: user(User), group(Group), member(false)
+	{
 	}
+};
 
+class ModuleInviteLdapException;
+
+/** Does LDAP lookups so the main thread never blocks on the LDAP server.
+ */
+class LDAPWorker : public SocketThread
+{
+	ModuleInviteLdapException* const parent;
+
+	/** The connection to the LDAP server, kept open between lookups. */
+	LDAP* conn;
+
+	/** The settings in use by the thread. Only touched by the thread. */
+	LDAPSettings current;
+
+	/** Set when the thread should exit. */
+	bool stopping;
 
 	///	\return	TRUE if the parameter looks like an LDAP group
-	bool isGroup(const char* groupname)
+	static bool IsGroup(const char* groupname)
 	{
 		const char *groupstr = "ou=Group";
 		const char *pos = strstr(groupname, groupstr);
@@ -71,134 +117,362 @@ public:
 			return false;
 		int after = *(pos + strlen(groupstr));
 		if (after == 0 || after == ',')
-			return pos == groupstr || *(pos-1) == ',';
+			return pos == groupname || *(pos-1) == ',';
 		return false;
 	}
 
-	bool isMember(const char* username, const char* groupname)
+	///	\return	TRUE if an attribute value refers to the user
+	static bool IsUser(const std::string& username, const char* value, bool exact)
 	{
-		LDAP*          ld;
-		LDAPMessage*   search_result;
-		LDAPMessage*   current_entry;
-		char*          dn;
-		int            version;
-		int            rc;
-		bool           result = false;
+		if (username.empty())
+			return false;
 
-		if (ldapserver.empty())
-			ldapserver = ServerInstance->Config->ConfValue("inviteldapexception")->getString("server");
+		const char* found = strstr(value, username.c_str());
+		if (!found)
+			return false;
+
+		///	\todo	nice check for username here too, so it doesn't match "usernameblabla"
+		if (!exact)
+			return true;
+
+		const char after = found[username.length()];
+		return found > value && found[-1] == '=' && (after == 0 || after == ',');
+	}
+
+	void Disconnect()
+	{
+		if (conn)
+			ldap_unbind(conn);
+		conn = NULL;
+	}
 
+	bool Connect(std::string& error)
+	{
 		/* Initialize the LDAP library and open a connection to an LDAP server */
-		if ( (ld = ldap_init(ldapserver.c_str(), LDAPSERVERPORT)) == NULL )
+		conn = ldap_init(current.server.c_str(), current.port);
+		if (!conn)
 		{
-			std::stringstream s;
-			s << "ERROR: Can't initialize connection to LDAP server " << ldapserver << ":" << LDAPSERVERPORT;
-			ServerInstance->Logs->Log("m_inviteldapexception", DEFAULT, s.str());
+			error = "ERROR: Can't initialize connection to LDAP server " + current.server + ":" + ConvToStr(current.port);
 			return false;
 		}
 
 		/* For TPF, set the client to an LDAPv3 client. */
-		version = LDAP_VERSION3;
-		ldap_set_option( ld, LDAP_OPT_PROTOCOL_VERSION, &version );
+		int version = LDAP_VERSION3;
+		ldap_set_option(conn, LDAP_OPT_PROTOCOL_VERSION, &version);
+
+		struct timeval tv;
+		tv.tv_sec = current.timeout;
+		tv.tv_usec = 0;
+		ldap_set_option(conn, LDAP_OPT_NETWORK_TIMEOUT, &tv);
 
 		/* Bind to the server. */
-		rc = ldap_simple_bind_s( ld, NULL, NULL );
-		if ( rc != LDAP_SUCCESS )
+		if (ldap_simple_bind_s(conn, NULL, NULL) != LDAP_SUCCESS)
 		{
-			std::stringstream s;
-			s << "ERROR: Can't bind to LDAP server " << ldapserver << ":" << LDAPSERVERPORT;
-			ServerInstance->Logs->Log("m_inviteldapexception", DEFAULT, s.str());
-			ldap_unbind( ld );
+			error = "ERROR: Can't bind to LDAP server " + current.server + ":" + ConvToStr(current.port);
+			Disconnect();
 			return false;
 		}
+		return true;
+	}
 
-		/* Perform the LDAP search */
-		std::string groupdn = ServerInstance->Config->ConfValue("inviteldapexception")->getString("base");
-		if (*groupname)
+	bool Search(const std::string& dn, LDAPMessage*& result, std::string& error)
+	{
+		for (int attempt = 0; attempt < 2; ++attempt)
 		{
-			groupdn.insert(0, std::string(groupname) + ",");
-			if (!strchr(groupname, '='))
-				groupdn.insert(0,"cn=");
+			if (!conn && !Connect(error))
+				return false;
+
+			struct timeval tv;
+			tv.tv_sec = current.timeout;
+			tv.tv_usec = 0;
+
+			result = NULL;
+			int rc = ldap_search_ext_s(conn, dn.c_str(), LDAP_SCOPE_SUBTREE, "(|(objectClass=groupOfNames)(objectClass=posixGroup))", 0, 0, NULL, NULL, &tv,
+					0, &result);
+			if (rc == LDAP_SUCCESS)
+			{
+				error.clear();
+				return true;
+			}
+
+			if (result)
+				ldap_msgfree(result);
+			result = NULL;
+
+			/* The server may have closed the connection since the last lookup so try again with a new one. */
+			if (rc != LDAP_SERVER_DOWN && rc != LDAP_CONNECT_ERROR)
+				return false;
+			Disconnect();
 		}
+		return false;
+	}
+
+	bool IsMember(const std::string& username, const std::string& groupname, unsigned int depth, std::string& error)
+	{
+		if (depth > MAX_GROUP_DEPTH)
+			return false;
 
-		rc = ldap_search_ext_s( ld, groupdn.c_str(), LDAP_SCOPE_SUBTREE, "(|(objectClass=groupOfNames)(objectClass=posixGroup))", 0, 0, NULL, NULL, NULL, 
-				0, &search_result );
+		/* Perform the LDAP search */
+		std::string groupdn = current.base;
+		if (!groupname.empty())
+		{
+			groupdn.insert(0, groupname + ",");
+			if (groupname.find('=') == std::string::npos)
+				groupdn.insert(0, "cn=");
+		}
 
 		/* Try to use groupname as full qualified */
-		if ( rc != LDAP_SUCCESS )
+		LDAPMessage* search_result;
+		if (!Search(groupdn, search_result, error) && !Search(groupname, search_result, error))
 		{
-			rc = ldap_search_ext_s( ld, groupname, LDAP_SCOPE_SUBTREE, "(|(objectClass=groupOfNames)(objectClass=posixGroup))", 0, 0, NULL, NULL, NULL, 
-					0, &search_result );
-			if ( rc != LDAP_SUCCESS )
-			{
-				std::cerr << "ERROR: LDAP search failed" << std::endl;
-				ldap_unbind( ld );
-				return false;
-			}
+			if (error.empty())
+				error = "ERROR: LDAP search failed for group " + groupname;
+			return false;
 		}
 
-		std::string attribs = ServerInstance->Config->ConfValue("inviteldapexception")->getString("attributes");
-		int ulen = strlen(username);
-		for (current_entry = ldap_first_entry(ld, search_result); current_entry != NULL; current_entry = 
-				ldap_next_entry(ld, current_entry))
+		bool result = false;
+		for (LDAPMessage* current_entry = ldap_first_entry(conn, search_result); !result && current_entry != NULL; current_entry =
+				ldap_next_entry(conn, current_entry))
 		{
 			BerElement* ber;
-			char* found;
-			for (char *attr = ldap_first_attribute(ld, current_entry, &ber); !result && attr; attr = ldap_next_attribute(ld, current_entry, ber))
+			for (char *attr = ldap_first_attribute(conn, current_entry, &ber); !result && attr; attr = ldap_next_attribute(conn, current_entry, ber))
 			{
-				//if (!strcmp(attr, "member") || !strcmp(attr,"uniqueMember") || !strcmp(attr,"memberUid"))
-				while (!result && !attribs.empty())
+				for (std::vector<std::string>::const_iterator s = current.attributes.begin(); !result && s != current.attributes.end(); ++s)
 				{
-					size_t comma = attribs.find(',');
-					std::string s; // current attribute
-					if (comma == attribs.npos)
-					{	// no more comma
-						s = attribs;
-						attribs = "";
-					}
-					else
-					{
-						s = attribs.substr(0, comma);
-						attribs = attribs.substr(comma+1);
-					}
-					if ((s[0] == '=' && s.substr(1) == attr) || (s[0] != '=' && s == attr))
+					const bool exact = ((*s)[0] == '=');
+					if (s->compare(exact ? 1 : 0, std::string::npos, attr) != 0)
+						continue;
+
+					char** vals = ldap_get_values(conn, current_entry, attr);
+					int size = ldap_count_values(vals);
+					for (int i = 0; !result && i < size; ++i)
 					{
-						char ** vals;
-						vals = ldap_get_values(ld, current_entry, attr);
-						int size = ldap_count_values(vals);
-						for (int i=0; !result && i<size; ++i)
-						{
-							if (isGroup(vals[i]))
-							{	// this is a group
-								if (isMember(username,vals[i]))
-									result = true;
-							}
-							else // this is a user
-								if (!*username || ((found = strstr(vals[i], username)) != NULL))
-								{	///	\todo	nice check for username here too, so it doesn't match "usernameblabla"
-									if (*username && s[0] != '=' && s == attr)
-										result = true;
-									else
-										if (*username && s[0] == '=' && *(found-1) == '=' && (*(found+ulen) == 0 || *(found+ulen) == ','))
-											result = true;
-								}
-						}
-						if (vals)
-							ldap_value_free(vals);
+						if (IsGroup(vals[i]))
+							result = IsMember(username, vals[i], depth + 1, error);
+						else
+							result = IsUser(username, vals[i], exact);
 					}
-
+					if (vals)
+						ldap_value_free(vals);
 				}
 				ldap_memfree(attr);
 			}
-			ber_free(ber, 0);
+			if (ber)
+				ber_free(ber, 0);
 		}
 
 		ldap_msgfree(search_result);
+		return result;
+	}
+
+ public:
+	/** Lookups waiting for the thread. Protected by the queue lock. */
+	std::deque<LDAPLookup> requests;
+
+	/** Lookups waiting for the main thread. Protected by the queue lock. */
+	std::deque<LDAPLookup> results;
+
+	/** The settings to use from the next lookup. Protected by the queue lock. */
+	LDAPSettings settings;
+
+	/** Set when settings has changed. Protected by the queue lock. */
+	bool reconnect;
+
+	LDAPWorker(ModuleInviteLdapException* Parent)
+		: parent(Parent), conn(NULL), stopping(false), reconnect(true)
+	{
+	}
+
+	void Run()
+	{
+		this->LockQueue();
+		while (!stopping && !this->GetExitFlag())
+		{
+			if (requests.empty())
+			{
+				this->WaitForQueue();
+				continue;
+			}
+
+			LDAPLookup lookup = requests.front();
+			requests.pop_front();
+			if (reconnect)
+			{
+				current = settings;
+				reconnect = false;
+				Disconnect();
+			}
+			this->UnlockQueue();
+
+			lookup.member = IsMember(lookup.user, lookup.group, 0, lookup.error);
+
+			this->LockQueue();
+			results.push_back(lookup);
+			this->NotifyParent();
+		}
+		this->UnlockQueue();
 
 		/* Disconnect from the server. */
-		ldap_unbind( ld );
+		Disconnect();
+	}
 
-		return result;
+	void OnNotify();
+
+	void Stop()
+	{
+		this->LockQueue();
+		stopping = true;
+		this->UnlockQueueWakeup();
+		this->join();
+	}
+};
+
+/** A join which is waiting for group lookups to finish.
+ */
+struct DeferredJoin
+{
+	std::string key;
+	time_t expires;
+};
+
+/** Deferred joins keyed by user UUID and channel name.
+ */
+typedef std::map<std::pair<std::string, std::string>, DeferredJoin> DeferredJoinMap;
+
+/** A cached group membership answer.
+ */
+struct CacheEntry
+{
+	bool member;
+	time_t expires;
+};
+
+typedef std::pair<std::string, std::string> LookupKey;
+typedef std::map<LookupKey, CacheEntry> LookupCache;
+
+class ModuleInviteLdapException : public Module
+{
+	InviteLdapException ie;
+	LDAPWorker*         worker;
+	LookupCache         cache;
+	std::set<LookupKey> pending;
+	DeferredJoinMap     deferred;
+	time_t              cachetime;
+	time_t              timeout;
+	bool                bypasskey;
+
+	/** Checks the cache for the groups on a +U list.
+	 * @return MOD_RES_ALLOW if the user is in one of the groups, MOD_RES_DENY if they are in none
+	 * of them, or MOD_RES_PASSTHRU if some of the groups have not been looked up yet.
+	 */
+	ModResult CheckCache(User* user, modelist* list, std::vector<std::string>* missing)
+	{
+		bool complete = true;
+		for (modelist::iterator it = list->begin(); it != list->end(); it++)
+		{
+			LookupCache::const_iterator entry = cache.find(LookupKey(user->nick, it->mask));
+			if (entry == cache.end() || entry->second.expires < ServerInstance->Time())
+			{
+				complete = false;
+				if (missing)
+					missing->push_back(it->mask);
+				continue;
+			}
+
+			if (entry->second.member)
+				return MOD_RES_ALLOW;
+		}
+		return complete ? MOD_RES_DENY : MOD_RES_PASSTHRU;
+	}
+
+	/** Checks whether a user can only join a channel by being on the +U list.
+	 */
+	bool NeedsException(LocalUser* user, Channel* chan, const std::string& keygiven)
+	{
+		bool invited = user->IsInvited(chan->name.c_str());
+		if (chan->IsModeSet('i') && !invited)
+			return true;
+
+		if (!bypasskey || (invited && ServerInstance->Config->InvBypassModes))
+			return false;
+
+		std::string ckey = chan->GetModeParameter('k');
+		return !ckey.empty() && ckey != keygiven;
+	}
+
+	void Queue(const std::string& user, const std::string& group)
+	{
+		if (!pending.insert(LookupKey(user, group)).second)
+			return;
+
+		ServerInstance->Logs->Log("m_inviteldapexception", DEBUG, "checking LDAP membership: for user: %s, group: %s", user.c_str(), group.c_str());
+		worker->LockQueue();
+		worker->requests.push_back(LDAPLookup(user, group));
+		worker->UnlockQueueWakeup();
+	}
+
+public:
+	ModuleInviteLdapException() : ie(this), worker(NULL), cachetime(300), timeout(5), bypasskey(true)
+	{
+		if (!ServerInstance->Modes->AddMode(&ie))
+			throw ModuleException("Could not add new modes!");
+
+		ie.DoImplements(this);
+		Implementation eventlist[] = { I_On005Numeric, I_OnCheckInvite, I_OnCheckKey, I_OnUserPreJoin, I_OnBackgroundTimer };
+		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+
+		worker = new LDAPWorker(this);
+		ServerInstance->Threads->Start(worker);
+		OnRehash(NULL);
+	}
+
+	~ModuleInviteLdapException()
+	{
+		if (worker)
+		{
+			worker->Stop();
+			delete worker;
+		}
+	}
+
+	void OnLookupsDone(std::deque<LDAPLookup>& lookups)
+	{
+		for (std::deque<LDAPLookup>::const_iterator i = lookups.begin(); i != lookups.end(); ++i)
+		{
+			const LookupKey key(i->user, i->group);
+			pending.erase(key);
+
+			const bool failed = !i->member && !i->error.empty();
+			if (failed)
+				ServerInstance->Logs->Log("m_inviteldapexception", DEFAULT, i->error);
+
+			CacheEntry& entry = cache[key];
+			entry.member = i->member;
+			entry.expires = ServerInstance->Time() + (failed ? std::min<time_t>(cachetime, ERROR_CACHE_TIME) : cachetime);
+		}
+
+		/* Retry the joins which can now be decided. */
+		for (DeferredJoinMap::iterator i = deferred.begin(); i != deferred.end(); )
+		{
+			User* user = ServerInstance->FindUUID(i->first.first);
+			Channel* chan = ServerInstance->FindChan(i->first.second);
+			modelist* list = chan ? ie.extItem.get(chan) : NULL;
+			std::vector<std::string> missing;
+			if (user && list && CheckCache(user, list, &missing) == MOD_RES_PASSTHRU)
+			{
+				/* The user may have changed nick or a group may have been added to the list. */
+				for (std::vector<std::string>::const_iterator group = missing.begin(); group != missing.end(); ++group)
+					Queue(user->nick, *group);
+				++i;
+				continue;
+			}
+
+			const std::string channel = i->first.second;
+			const std::string key = i->second.key;
+			deferred.erase(i++);
+			if (IS_LOCAL(user) && chan)
+				Channel::JoinUser(user, channel.c_str(), false, key.c_str(), false, ServerInstance->Time());
+		}
 	}
 
 	void On005Numeric(std::string &output)
@@ -206,22 +480,37 @@ public:
 		output.append(" LDAPEX=U");
 	}
 
+	ModResult OnUserPreJoin(User* user, Channel* chan, const char* cname, std::string& privs, const std::string& keygiven)
+	{
+		LocalUser* localuser = IS_LOCAL(user);
+		if (!localuser || !chan)
+			return MOD_RES_PASSTHRU;
+
+		modelist* list = ie.extItem.get(chan);
+		if (!list || list->empty() || !NeedsException(localuser, chan, keygiven))
+			return MOD_RES_PASSTHRU;
+
+		std::vector<std::string> missing;
+		if (CheckCache(user, list, &missing) != MOD_RES_PASSTHRU)
+			return MOD_RES_PASSTHRU;
+
+		/* Hold the join back until the worker has answered. */
+		for (std::vector<std::string>::const_iterator i = missing.begin(); i != missing.end(); ++i)
+			Queue(user->nick, *i);
+		DeferredJoin& join = deferred[std::make_pair(user->uuid, chan->name)];
+		if (!join.expires)
+			join.expires = ServerInstance->Time() + timeout + DEFERRED_JOIN_GRACE;
+		join.key = keygiven;
+		return MOD_RES_DENY;
+	}
+
 	ModResult OnCheckInvite(User* user, Channel* chan)
 	{
 		if(chan != NULL)
 		{
 			modelist* list = ie.extItem.get(chan);
-			if (list)
-			{
-				for (modelist::iterator it = list->begin(); it != list->end(); it++)
-				{
-					ServerInstance->Logs->Log("CONNECT", NONE, "checking LDAP membership: for user: %s, group: %s", user->nick.c_str(), it->mask.c_str());
-					if (isMember(user->nick.c_str(), it->mask.c_str()))
-					{
-						return MOD_RES_ALLOW;
-					}
-				}
-			}
+			if (list && CheckCache(user, list, NULL) == MOD_RES_ALLOW)
+				return MOD_RES_ALLOW;
 		}
 
 		return MOD_RES_PASSTHRU;
@@ -229,11 +518,37 @@ public:
 
 	ModResult OnCheckKey(User* user, Channel* chan, const std::string& key)
 	{
-		if (ServerInstance->Config->ConfValue("inviteldapexception")->getBool("bypasskey", true))
+		if (bypasskey)
 			return OnCheckInvite(user, chan);
 		return MOD_RES_PASSTHRU;
 	}
 
+	void OnBackgroundTimer(time_t curtime)
+	{
+		for (LookupCache::iterator i = cache.begin(); i != cache.end(); )
+		{
+			if (i->second.expires < curtime)
+				cache.erase(i++);
+			else
+				++i;
+		}
+
+		/* Give up on joins which have waited too long for an answer. */
+		for (DeferredJoinMap::iterator i = deferred.begin(); i != deferred.end(); )
+		{
+			if (i->second.expires >= curtime)
+			{
+				++i;
+				continue;
+			}
+
+			User* user = ServerInstance->FindUUID(i->first.first);
+			if (IS_LOCAL(user))
+				user->WriteNumeric(ERR_INVITEONLYCHAN, "%s %s :Cannot join channel (LDAP group lookup timed out)", user->nick.c_str(), i->first.second.c_str());
+			deferred.erase(i++);
+		}
+	}
+
 	void OnCleanup(int target_type, void* item)
 	{
 		ie.DoCleanup(target_type, item);
@@ -248,7 +563,31 @@ public:
 	{
 		ie.DoRehash();
 
-		ldapserver = ServerInstance->Config->ConfValue("inviteldapexception")->getString("server");
+		ConfigTag* tag = ServerInstance->Config->ConfValue("inviteldapexception");
+		LDAPSettings settings;
+		settings.server = tag->getString("server");
+		settings.port = tag->getInt("port", LDAPSERVERPORT);
+		settings.base = tag->getString("base");
+		settings.timeout = tag->getInt("timeout", 5);
+
+		irc::commasepstream attribs(tag->getString("attributes"));
+		for (std::string attrib; attribs.GetToken(attrib); )
+		{
+			if (!attrib.empty())
+				settings.attributes.push_back(attrib);
+		}
+
+		cachetime = tag->getInt("cachetime", 300);
+		timeout = settings.timeout;
+		bypasskey = tag->getBool("bypasskey", true);
+
+		/* Answers from the old server may no longer be right. */
+		cache.clear();
+
+		worker->LockQueue();
+		worker->settings = settings;
+		worker->reconnect = true;
+		worker->UnlockQueue();
 	}
 
 	Version GetVersion()
@@ -257,4 +596,14 @@ public:
 	}
 };
 
+void LDAPWorker::OnNotify()
+{
+	std::deque<LDAPLookup> done;
+	this->LockQueue();
+	done.swap(results);
+	this->UnlockQueue();
+
+	parent->OnLookupsDone(done);
+}
+
 MODULE_INIT(ModuleInviteLdapException)
@@ -39,12 +39,175 @@ class QuietBan : public ListModeBase
 
 };
 
+/** Lower cases a string in the same way as InspIRCd::Match.
+*/
+static std::string LowerCase(const std::string& str)
+{
+	std::string result(str);
+	for (std::string::iterator it = result.begin(); it != result.end(); ++it)
+		*it = national_case_insensitive_map[static_cast<unsigned char>(*it)];
+	return result;
+}
+
+/** Parses a *!*@<ip>/<length> entry into a CIDR mask.
+*/
+static bool ParseCIDR(const std::string& mask, irc::sockets::cidr_mask& cidr)
+{
+	if (mask.compare(0, 4, "*!*@") != 0)
+		return false;
+
+	std::string::size_type slash = mask.find('/', 4);
+	if (slash == std::string::npos || slash + 1 >= mask.length())
+		return false;
+
+	if (mask.find_first_not_of("0123456789", slash + 1) != std::string::npos)
+		return false;
+
+	irc::sockets::sockaddrs sa;
+	if (!irc::sockets::aptosa(mask.substr(4, slash - 4), 0, sa))
+		return false;
+
+	cidr = irc::sockets::cidr_mask(sa, ConvToInt(mask.substr(slash + 1)));
+	return true;
+}
+
+/** A +q list which has been split up so that most entries don't need to be glob matched.
+*/
+class QuietMatcher
+{
+	public:
+		/** Changes every time a matcher is built so old verdicts can be spotted. */
+		const unsigned long generation;
+
+		/** The size of the list that this matcher was built from. */
+		const size_t size;
+
+		/** Entries without any wildcards, lower cased. */
+		std::set<std::string> exact;
+
+		/** Entries in the form *!*@<ip>/<length>, already masked. */
+		std::set<irc::sockets::cidr_mask> cidrs;
+
+		/** The address families and prefix lengths used in cidrs. */
+		std::set<std::pair<unsigned char, unsigned char> > cidrlengths;
+
+		/** Entries which still need to be glob matched. */
+		std::vector<std::string> globs;
+
+		QuietMatcher(unsigned long Generation, modelist* list)
+			: generation(Generation)
+			, size(list->size())
+		{
+			for (modelist::iterator it = list->begin(); it != list->end(); it++)
+			{
+				irc::sockets::cidr_mask cidr;
+				if (it->mask.find_first_of("*?/") == std::string::npos)
+					exact.insert(LowerCase(it->mask));
+				else if (ParseCIDR(it->mask, cidr))
+				{
+					cidrs.insert(cidr);
+					cidrlengths.insert(std::make_pair(cidr.type, cidr.length));
+				}
+				else
+					globs.push_back(it->mask);
+			}
+		}
+
+		bool Matches(User* user) const
+		{
+			/* Copied from m_banredirect.cpp */
+			std::string ipmask(user->nick);
+			ipmask.append(1, '!').append(user->MakeHostIP());
+
+			if (!exact.empty())
+			{
+				if (exact.count(LowerCase(user->GetFullHost())) || exact.count(LowerCase(user->GetFullRealHost())) || exact.count(LowerCase(ipmask)))
+					return true;
+			}
+
+			if (!cidrs.empty())
+			{
+				// cidr_mask::type holds the address family of the mask.
+				const unsigned char family = user->client_sa.sa.sa_family;
+				for (std::set<std::pair<unsigned char, unsigned char> >::const_iterator it = cidrlengths.begin(); it != cidrlengths.end(); ++it)
+				{
+					if (it->first == family && cidrs.count(irc::sockets::cidr_mask(user->client_sa, it->second)))
+						return true;
+				}
+			}
+
+			for (std::vector<std::string>::const_iterator it = globs.begin(); it != globs.end(); ++it)
+			{
+				if (InspIRCd::Match(user->GetFullHost(), *it) ||
+					InspIRCd::Match(user->GetFullRealHost(), *it) ||
+					InspIRCd::MatchCIDR(ipmask, *it))
+					return true;
+			}
+
+			return false;
+		}
+};
+
+/** Whether a member matched the +q list when it was last checked.
+*/
+struct QuietVerdict
+{
+	unsigned long generation;
+	bool quiet;
+
+	QuietVerdict(unsigned long Generation, bool Quiet)
+		: generation(Generation)
+		, quiet(Quiet)
+	{
+	}
+};
+
 class ModuleQuietBan : public Module
 {
 	QuietBan qb;
+	SimpleExtItem<QuietMatcher> matchers;
+	SimpleExtItem<QuietVerdict> verdicts;
+	unsigned long generation;
+
+	bool IsQuiet(User* user, Channel* chan, modelist* list)
+	{
+		QuietMatcher* matcher = matchers.get(chan);
+		if (!matcher || matcher->size != list->size())
+		{
+			matcher = new QuietMatcher(++generation, list);
+			matchers.set(chan, matcher);
+		}
+
+		/* Users who are not in the channel can't have a cached verdict. */
+		Membership* memb = chan->GetUser(user);
+		if (!memb)
+			return matcher->Matches(user);
+
+		QuietVerdict* verdict = verdicts.get(memb);
+		if (!verdict || verdict->generation != matcher->generation)
+		{
+			verdict = new QuietVerdict(matcher->generation, matcher->Matches(user));
+			verdicts.set(memb, verdict);
+		}
+		return verdict->quiet;
+	}
+
+	void ForgetVerdicts(User* user)
+	{
+		for (UCListIter it = user->chans.begin(); it != user->chans.end(); ++it)
+		{
+			Membership* memb = (*it)->GetUser(user);
+			if (memb)
+				verdicts.unset(memb);
+		}
+	}
 
 	public:
-		ModuleQuietBan() : qb(this)
+		ModuleQuietBan()
+			: qb(this)
+			, matchers("quietban-matcher", this)
+			, verdicts("quietban-verdict", this)
+			, generation(0)
 		{
 		}
 
@@ -54,12 +217,14 @@ class ModuleQuietBan : public Module
 				throw ModuleException("Cannot load with: m_muteban.so or m_chanprotect.so.");
 
 			ServerInstance->Modules->AddService(qb);
+			ServerInstance->Modules->AddService(matchers);
+			ServerInstance->Modules->AddService(verdicts);
 
 			/* Populate Implements list with the events for a List Mode */
 			qb.DoImplements(this);
 
-			Implementation list[] = { I_OnUserPreNotice, I_OnUserPreMessage };
-			ServerInstance->Modules->Attach(list, this, 2);
+			Implementation list[] = { I_OnUserPreNotice, I_OnUserPreMessage, I_OnRawMode, I_OnChangeHost, I_OnChangeIdent, I_OnUserPostNick };
+			ServerInstance->Modules->Attach(list, this, sizeof(list)/sizeof(Implementation));
 		}
 
 		ModResult OnUserPreMessage(User* user, void* dest, int target_type, std::string &text, char status, CUList &exempt_list)
@@ -76,28 +241,44 @@ class ModuleQuietBan : public Module
 				modelist *list = qb.extItem.get(chan);
 
 				/* No list, continue. */
-				if (!list)
+				if (!list || list->empty())
 					return MOD_RES_PASSTHRU;
 
-				/* Copied from m_banredirect.cpp */
-				std::string ipmask(user->nick);
-				ipmask.append(1, '!').append(user->MakeHostIP());
-
 				/* If this matches, then they match a +q, & don't allow them to speak. */
-				for (modelist::iterator it = list->begin(); it != list->end(); it++)
-					if (InspIRCd::Match(user->GetFullHost(), it->mask) ||
-						InspIRCd::Match(user->GetFullRealHost(), it->mask) ||
-						InspIRCd::MatchCIDR(ipmask, it->mask))
-					{
-						/* lol 404 */
-						user->WriteNumeric(404, "%s %s :Cannot send to channel (You are muted (+q))", user->nick.c_str(), chan->name.c_str());
-						return MOD_RES_DENY;
-					}
+				if (IsQuiet(user, chan, list))
+				{
+					/* lol 404 */
+					user->WriteNumeric(404, "%s %s :Cannot send to channel (You are muted (+q))", user->nick.c_str(), chan->name.c_str());
+					return MOD_RES_DENY;
+				}
 			}
 
 			return MOD_RES_PASSTHRU;
 		}
 
+		ModResult OnRawMode(User* user, Channel* chan, const char mode, const std::string& param, bool adding, int pcnt)
+		{
+			/* The list is about to change so the matcher needs to be rebuilt. */
+			if (chan && mode == qb.GetModeChar())
+				matchers.unset(chan);
+			return MOD_RES_PASSTHRU;
+		}
+
+		void OnChangeHost(User* user, const std::string& newhost)
+		{
+			ForgetVerdicts(user);
+		}
+
+		void OnChangeIdent(User* user, const std::string& newident)
+		{
+			ForgetVerdicts(user);
+		}
+
+		void OnUserPostNick(User* user, const std::string& oldnick)
+		{
+			ForgetVerdicts(user);
+		}
+
 		ModResult OnUserPreNotice(User* user, void* dest, int target_type, std::string &text, char status, CUList &exempt_list)
 		{
 			return OnUserPreMessage(user, dest, target_type, text, status, exempt_list);
@@ -27,19 +27,68 @@
 /* $ModDesc: Provides the /STUN command, which stops a user from receiving messages/notices to channels */
 /* $ModDepends: core 2.0 */
 
+/** Lower cases a string in the same way as InspIRCd::Match.
+ */
+static std::string LowerCase(const std::string& str)
+{
+	std::string result(str);
+	for (std::string::iterator iter = result.begin(); iter != result.end(); ++iter)
+		*iter = national_case_insensitive_map[static_cast<unsigned char>(*iter)];
+	return result;
+}
+
 class Stun : public XLine
 {
  public:
+	/** Changes whenever a stun is added or removed so that cached verdicts can be spotted. */
+	static unsigned long generation;
+
+	/** The number of stuns which exist. */
+	static size_t count;
+
+	/** The lower cased masks of the stuns which contain no wildcards. */
+	static std::multiset<std::string> exactmasks;
+
+	/** The earliest time at which a stun expires or 0 if none of them expire. */
+	static time_t nextexpiry;
+
 	std::string matchtext;
+	bool exact;
 
 	Stun(time_t s_time, long d, const std::string& src, const std::string& re, const std::string& stunmask)
 		: XLine(s_time, d, src, re, "STUN")
 		, matchtext(stunmask)
+		, exact(stunmask.find_first_of("*?") == std::string::npos)
 	{
+		if (exact)
+			exactmasks.insert(LowerCase(matchtext));
+		if (duration && (!nextexpiry || expiry < nextexpiry))
+			nextexpiry = expiry;
+
+		count++;
+		generation++;
 	}
 
 	~Stun()
 	{
+		if (exact)
+		{
+			std::multiset<std::string>::iterator iter = exactmasks.find(LowerCase(matchtext));
+			if (iter != exactmasks.end())
+				exactmasks.erase(iter);
+		}
+
+		count--;
+		generation++;
+	}
+
+	static bool MatchesExact(User* u)
+	{
+		if (exactmasks.empty())
+			return false;
+
+		return exactmasks.count(LowerCase(u->GetFullHost())) || exactmasks.count(LowerCase(u->GetFullRealHost())) ||
+			exactmasks.count(LowerCase(u->nick+"!"+u->ident+"@"+u->GetIPString()));
 	}
 
 	bool Matches(User *u)
@@ -93,6 +142,11 @@ class StunFactory : public XLineFactory
 	}
 };
 
+unsigned long Stun::generation = 1;
+size_t Stun::count = 0;
+std::multiset<std::string> Stun::exactmasks;
+time_t Stun::nextexpiry = 0;
+
 //typedef std::vector<Stun> stunlist;
 
 class CommandStun : public Command
@@ -181,13 +235,71 @@ class ModuleStun : public Module
 {
 	CommandStun cmd;
 	StunFactory f;
+	LocalIntExt verdicts;
 	bool affectopers;
 
 	std::string deaf_bypasschars;
 	std::string deaf_bypasschars_uline;
 
+	/** Removes the stuns which have expired and works out when the next one expires.
+	 */
+	void ExpireStuns()
+	{
+		// GetAll removes any expired lines.
+		XLineLookup* lines = ServerInstance->XLines->GetAll("STUN");
+
+		Stun::nextexpiry = 0;
+		if (!lines)
+			return;
+
+		for (LookupIter iter = lines->begin(); iter != lines->end(); ++iter)
+		{
+			XLine* line = iter->second;
+			if (line->duration && (!Stun::nextexpiry || line->expiry < Stun::nextexpiry))
+				Stun::nextexpiry = line->expiry;
+		}
+	}
+
+	/** Checks whether a user is stunned. The result is cached on the user until
+	 * a stun is added or removed or the user's nick, ident or host changes.
+	 */
+	bool IsStunned(User* user)
+	{
+		// E: overrides stun
+		if (user->exempt)
+			return false;
+
+		const intptr_t cached = verdicts.get(user);
+		if (static_cast<unsigned long>(cached >> 1) == Stun::generation)
+			return cached & 1;
+
+		// GetAll removes any expired lines so it needs to be called before checking the exact masks.
+		XLineLookup* lines = ServerInstance->XLines->GetAll("STUN");
+		bool stunned = Stun::MatchesExact(user);
+		if (!stunned)
+		{
+			if (lines)
+			{
+				for (LookupIter iter = lines->begin(); iter != lines->end(); ++iter)
+				{
+					Stun* stun = static_cast<Stun*>(iter->second);
+					if (!stun->exact && stun->Matches(user))
+					{
+						stunned = true;
+						break;
+					}
+				}
+			}
+		}
+
+		verdicts.set(user, (static_cast<intptr_t>(Stun::generation) << 1) | stunned);
+		return stunned;
+	}
+
  public:
-	ModuleStun() : cmd(this)
+	ModuleStun()
+		: cmd(this)
+		, verdicts("stun-verdict", this)
 	{
 	}
 
@@ -195,8 +307,9 @@ class ModuleStun : public Module
 	{
 		ServerInstance->XLines->RegisterFactory(&f);
 		ServerInstance->Modules->AddService(cmd);
+		ServerInstance->Modules->AddService(verdicts);
 
-		Implementation eventlist[] = { I_OnStats, I_OnUserPreMessage, I_OnUserPreNotice, I_OnRehash };
+		Implementation eventlist[] = { I_OnStats, I_OnUserPreMessage, I_OnUserPreNotice, I_OnRehash, I_OnUserPostNick, I_OnChangeHost, I_OnChangeIdent };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 		OnRehash(NULL);
 	}
@@ -236,6 +349,21 @@ class ModuleStun : public Module
 		affectopers = tag->getBool("affectopers", false);
 	}
 
+	void OnUserPostNick(User* user, const std::string& oldnick)
+	{
+		verdicts.set(user, 0);
+	}
+
+	void OnChangeHost(User* user, const std::string& newhost)
+	{
+		verdicts.set(user, 0);
+	}
+
+	void OnChangeIdent(User* user, const std::string& newident)
+	{
+		verdicts.set(user, 0);
+	}
+
 	/*
 	 * The rest of the code is mostly taken from m_deaf.so
 	 * Copyright (C) 2006-2007 Dennis Friis <peavey@inspircd.org>
@@ -294,10 +422,17 @@ class ModuleStun : public Module
 		if (!is_bypasschar_uline_avail && is_bypasschar)
 			return;
 
+		/* Nobody can be stunned, no build required. */
+		if (!Stun::count)
+			return;
+
+		if (Stun::nextexpiry && ServerInstance->Time() > Stun::nextexpiry)
+			ExpireStuns();
+
 		for (UserMembCIter i = ulist->begin(); i != ulist->end(); i++)
 		{
 			/* Not stunned, don't touch. */
-			if (!ServerInstance->XLines->MatchesLine("STUN", i->first))
+			if (!IsStunned(i->first))
 				continue;
 
 			/* Don't do anything if the user is an operator and affectopers isn't set */
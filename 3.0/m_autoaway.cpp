@@ -33,6 +33,9 @@ enum
 	RPL_NOWAWAY = 306
 };
 
+// The UUIDs of users who may become idle keyed by the time at which they will be.
+typedef std::multimap<time_t, std::string> DeadlineMap;
+
 class ModuleAutoAway
 	: public Module
 	, public Timer
@@ -40,27 +43,61 @@ class ModuleAutoAway
 {
  private:
 	LocalIntExt autoaway;
+	LocalIntExt deadline;
 	Away::EventProvider awayevprov;
+	DeadlineMap deadlines;
 	unsigned long idleperiod;
 	std::string message;
 	bool setting;
 
+	void Schedule(LocalUser* user)
+	{
+		time_t when = std::max<time_t>(user->idle_lastmsg + idleperiod, ServerInstance->Time());
+		deadline.set(user, when);
+		deadlines.insert(std::make_pair(when, user->uuid));
+	}
+
+	void ScheduleAll()
+	{
+		deadlines.clear();
+		const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+		{
+			LocalUser* user = *iter;
+			if (user->registered == REG_ALL && !user->IsAway())
+				Schedule(user);
+		}
+	}
+
  public:
 	ModuleAutoAway()
 		: Timer(0, true)
 		, Away::EventListener(this)
-		, autoaway("autoaway", ExtensionItem::EXT_CHANNEL, this)
+		, autoaway("autoaway", ExtensionItem::EXT_USER, this)
+		, deadline("autoaway-deadline", ExtensionItem::EXT_USER, this)
 		, awayevprov(this)
+		, idleperiod(0)
 		, setting(false)
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Timers.AddTimer(this);
+	}
+
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("autoaway");
 		SetInterval(tag->getDuration("checkperiod", 5*60));
-		idleperiod = tag->getDuration("idleperiod", 24*60*60);
 		message = tag->getString("message", "Idle");
+
+		unsigned long newidleperiod = tag->getDuration("idleperiod", 24*60*60);
+		if (newidleperiod != idleperiod)
+		{
+			idleperiod = newidleperiod;
+			ScheduleAll();
+		}
 	}
 
 	bool Tick(time_t) CXX11_OVERRIDE
@@ -68,25 +105,44 @@ class ModuleAutoAway
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Checking for idle users ...");
 		setting = true;
 		time_t idlethreshold = ServerInstance->Time() - idleperiod;
-		const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
-		for (UserManager::LocalList::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+		DeadlineMap::iterator iter = deadlines.begin();
+		for (; iter != deadlines.end() && iter->first <= ServerInstance->Time(); ++iter)
 		{
-			LocalUser* user = *iter;
+			// Skip users who have quit or who have been rescheduled since this entry was added.
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(iter->second));
+			if (!user || static_cast<time_t>(deadline.get(user)) != iter->first)
+				continue;
 
-			// Skip users who are already away or who are not idle.
-			if (user->IsAway() || user->idle_lastmsg > idlethreshold)
+			// Users who are already away will be rescheduled when they come back.
+			deadline.set(user, 0);
+			if (user->IsAway())
 				continue;
 
+			// Users who have spoken since they were scheduled need to be checked again later.
+			if (user->idle_lastmsg > idlethreshold)
+			{
+				Schedule(user);
+				continue;
+			}
+
 			autoaway.set(user, 1);
 			user->awaytime = ServerInstance->Time();
 			user->awaymsg.assign(message, 0, ServerInstance->Config->Limits.MaxAway);
 			user->WriteNumeric(RPL_NOWAWAY, "You have been automatically marked as being away");
 			FOREACH_MOD_CUSTOM(awayevprov, Away::EventListener, OnUserAway, (user));
 		}
+		deadlines.erase(deadlines.begin(), iter);
 		setting = false;
 		return true;
 	}
 
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		LocalUser* luser = IS_LOCAL(user);
+		if (luser)
+			Schedule(luser);
+	}
+
 	void OnUserAway(User* user) CXX11_OVERRIDE
 	{
 		// If the user is changing their away status then unmark them.
@@ -97,8 +153,12 @@ class ModuleAutoAway
 	void OnUserBack(User* user) CXX11_OVERRIDE
 	{
 		// If the user is unsetting their away status then unmark them.
-		if (IS_LOCAL(user))
-			autoaway.set(user, 0);
+		LocalUser* luser = IS_LOCAL(user);
+		if (luser)
+		{
+			autoaway.set(luser, 0);
+			Schedule(luser);
+		}
 	}
 
 	void OnUserPostMessage(User* user, const MessageTarget& target, const MessageDetails& details) CXX11_OVERRIDE
@@ -49,20 +49,93 @@ struct ClientInfo
 	Regex* pattern;
 };
 
-class ModuleClientCheck : public Module
+// Times at which we stop waiting for a version reply, keyed by expiry time.
+typedef std::multimap<time_t, std::string> DeadlineList;
+
+class ModuleClientCheck
+	: public Module
+	, public Timer
 {
  private:
 	LocalIntExt ext;
+	DeadlineList deadlines;
+
+	// How long to wait for a version reply before giving up.
+	unsigned long timeout;
 	std::vector<ClientInfo> clients;
 	dynamic_reference_nocheck<RegexFactory> rf;
 	std::string origin;
 	std::string originnick;
 
+	// The number of users who we are waiting on a version reply from.
+	size_t pending;
+
+	// Buffer which the version string is extracted into.
+	std::string version;
+
+	static bool IsVersionReply(const std::string& text)
+	{
+		static const char prefix[] = "\1VERSION ";
+		static const size_t prefixlen = sizeof(prefix) - 1;
+		if (text.length() <= prefixlen)
+			return false;
+
+		for (size_t idx = 0; idx < prefixlen; ++idx)
+		{
+			if (national_case_insensitive_map[static_cast<unsigned char>(text[idx])] != national_case_insensitive_map[static_cast<unsigned char>(prefix[idx])])
+				return false;
+		}
+		return true;
+	}
+
+	void StartChecking(LocalUser* user)
+	{
+		ext.set(user, 1);
+		deadlines.insert(std::make_pair(ServerInstance->Time() + timeout, user->uuid));
+
+		// We only need to look at commands whilst a reply is outstanding.
+		if (!pending++)
+			ServerInstance->Modules->Attach(I_OnPreCommand, this);
+	}
+
+	void StopChecking(LocalUser* user)
+	{
+		if (!ext.get(user))
+			return;
+
+		ext.unset(user);
+		if (!--pending)
+			ServerInstance->Modules->Detach(I_OnPreCommand, this);
+	}
+
  public:
 	ModuleClientCheck()
-		: ext("checking-client-version", ExtensionItem::EXT_USER, this)
+		: Timer(1, true)
+		, ext("checking-client-version", ExtensionItem::EXT_USER, this)
+		, timeout(30)
 		, rf(this, "regex")
+		, pending(0)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
 	{
+		ServerInstance->Modules->Detach(I_OnPreCommand, this);
+		ServerInstance->Timers.AddTimer(this);
+	}
+
+	bool Tick(time_t currtime) CXX11_OVERRIDE
+	{
+		// Many clients never reply to a version request so stop waiting after a while.
+		DeadlineList::iterator it = deadlines.begin();
+		for (; it != deadlines.end() && it->first <= currtime; ++it)
+		{
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(it->second));
+			if (user)
+				StopChecking(user);
+		}
+		deadlines.erase(deadlines.begin(), it);
+		return true;
 	}
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
@@ -74,6 +147,8 @@ class ModuleClientCheck : public Module
 		if (!newrf)
 			throw ModuleException("<clientcheck:engine> (" + engine + ") is not a recognised regex engine.");
 
+		timeout = clientcheck->getDuration("timeout", 30, 1);
+
 		const std::string neworigin = clientcheck->getString("origin", ServerInstance->Config->ServerName);
 		if (neworigin.empty() || neworigin.find(' ') != std::string::npos)
 			throw ModuleException("<clientcheck:origin> (" + neworigin + ") is not a valid nick!user@host mask.");
@@ -120,7 +195,7 @@ class ModuleClientCheck : public Module
 
 	void OnUserConnect(LocalUser* user) CXX11_OVERRIDE
 	{
-		ext.set(user, 1);
+		StartChecking(user);
 
 		ClientProtocol::Messages::Privmsg msg(origin, user, "\x1VERSION\x1", MSG_PRIVMSG);
 		user->Send(ServerInstance->GetRFCEvents().privmsg, msg);
@@ -137,52 +212,54 @@ class ModuleClientCheck : public Module
 		if (parameters[0] != originnick)
 			return MOD_RES_PASSTHRU;
 
-		if (parameters[1].length() < 10 || parameters[1][0] != '\x1')
+		const std::string& text = parameters[1];
+		if (!IsVersionReply(text))
 			return MOD_RES_PASSTHRU;
 
-		const std::string prefix = parameters[1].substr(0, 9);
-		if (!irc::equals(prefix, "\1VERSION "))
-			return MOD_RES_PASSTHRU;
+		// Strip the "\1VERSION " prefix and the optional trailing "\1".
+		const size_t length = text.length() - 9 - (text[text.length() - 1] == '\x1' ? 1 : 0);
+		version.assign(text, 9, length);
 
-		size_t msgsize = parameters[1].size();
-		size_t lastpos = msgsize - (parameters[1][msgsize - 1] == '\x1' ? 9 : 10);
+		StopChecking(user);
+		for (std::vector<ClientInfo>::const_iterator iter = clients.begin(); iter != clients.end(); ++iter)
+		{
+			const ClientInfo& ci = *iter;
+			if (!ci.pattern->Matches(version))
+				continue;
 
-		const std::string version = parameters[1].substr(9, lastpos);
-			for (std::vector<ClientInfo>::const_iterator iter = clients.begin(); iter != clients.end(); ++iter)
+			switch (ci.action)
 			{
-				const ClientInfo& ci = *iter;
-				if (!ci.pattern->Matches(version))
-					continue;
-
-				switch (ci.action)
+				case CA_KILL:
+				{
+					ServerInstance->Users->QuitUser(user, ci.message);
+					break;
+				}
+				case CA_NOTICE:
+				{
+					ClientProtocol::Messages::Privmsg msg(ClientProtocol::Messages::Privmsg::nocopy,
+						origin, user, ci.message, MSG_NOTICE);
+					user->Send(ServerInstance->GetRFCEvents().privmsg, msg);
+					break;
+				}
+				case CA_PRIVMSG:
 				{
-					case CA_KILL:
-					{
-						ServerInstance->Users->QuitUser(user, ci.message);
-						break;
-					}
-					case CA_NOTICE:
-					{
-						ClientProtocol::Messages::Privmsg msg(ClientProtocol::Messages::Privmsg::nocopy,
-							origin, user, ci.message, MSG_NOTICE);
-						user->Send(ServerInstance->GetRFCEvents().privmsg, msg);
-						break;
-					}
-					case CA_PRIVMSG:
-					{
-						ClientProtocol::Messages::Privmsg msg(ClientProtocol::Messages::Privmsg::nocopy,
-							origin, user, ci.message, MSG_PRIVMSG);
-						user->Send(ServerInstance->GetRFCEvents().privmsg, msg);
-						break;
-					}
+					ClientProtocol::Messages::Privmsg msg(ClientProtocol::Messages::Privmsg::nocopy,
+						origin, user, ci.message, MSG_PRIVMSG);
+					user->Send(ServerInstance->GetRFCEvents().privmsg, msg);
+					break;
 				}
-				break;
 			}
+			break;
+		}
 
-		ext.unset(user);
 		return MOD_RES_DENY;
 	}
 
+	void OnUserDisconnect(LocalUser* user) CXX11_OVERRIDE
+	{
+		StopChecking(user);
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Allows detection of clients by version string.");
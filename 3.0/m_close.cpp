@@ -25,45 +25,220 @@
 
 #include "inspircd.h"
 
+// Restricts which unknown connections are closed.
+struct CloseFilter
+{
+	// If non-zero then the port of the listener the connection was accepted on.
+	int port;
+
+	// If non-empty then a CIDR range the connection must be from.
+	std::string cidr;
+
+	// The minimum number of seconds since the connection was accepted.
+	unsigned long minage;
+
+	CloseFilter()
+		: port(0)
+		, minage(0)
+	{
+	}
+
+	bool Matches(LocalUser* user) const
+	{
+		if (user->registered == REG_ALL || user->quitting)
+			return false;
+
+		if (port && user->server_sa.port() != port)
+			return false;
+
+		if (minage && static_cast<unsigned long>(ServerInstance->Time() - user->signon) < minage)
+			return false;
+
+		if (!cidr.empty() && !InspIRCd::MatchCIDR(user->GetIPString(), cidr))
+			return false;
+
+		return true;
+	}
+};
+
+// Counts the connections which were closed on each listener.
+struct CloseSummary
+{
+	typedef std::map<int, unsigned int> PortCounts;
+
+	PortCounts ports;
+	unsigned int total;
+
+	CloseSummary()
+		: total(0)
+	{
+	}
+
+	void Add(LocalUser* user)
+	{
+		ports[user->server_sa.port()]++;
+		total++;
+	}
+
+	void Send(User* src) const
+	{
+		for (PortCounts::const_iterator ci = ports.begin(); ci != ports.end(); ++ci)
+		{
+			src->WriteNotice("*** Closed " + ConvToStr(ci->second) + " unknown " + (ci->second == 1 ? "connection" : "connections") +
+				" on port " + ConvToStr(ci->first));
+		}
+		if (total)
+			src->WriteNotice("*** " + ConvToStr(total) + " unknown " + (total == 1 ? "connection" : "connections") + " closed");
+		else
+			src->WriteNotice("*** No unknown connections found");
+	}
+};
+
+// A close request which is processed a batch at a time.
+struct CloseJob
+{
+	// The UUID of the user who requested the close.
+	std::string uuid;
+
+	// The maximum number of connections to close per second.
+	unsigned long batchsize;
+
+	CloseFilter filter;
+	CloseSummary summary;
+};
+
+static size_t CloseConnections(const CloseFilter& filter, CloseSummary& summary, size_t max)
+{
+	size_t closed = 0;
+	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
+	for (UserManager::LocalList::const_iterator u = list.begin(); u != list.end() && closed < max; )
+	{
+		// Quitting the user removes it from the list
+		LocalUser* user = *u;
+		++u;
+		if (filter.Matches(user))
+		{
+			ServerInstance->Users->QuitUser(user, "Closing all unknown connections per request");
+			summary.Add(user);
+			closed++;
+		}
+	}
+	return closed;
+}
+
+class CloseTimer : public Timer
+{
+ public:
+	std::list<CloseJob> jobs;
+
+	CloseTimer()
+		: Timer(1, true)
+	{
+	}
+
+	void Queue(const CloseJob& job)
+	{
+		if (jobs.empty())
+			ServerInstance->Timers.AddTimer(this);
+		jobs.push_back(job);
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE
+	{
+		for (std::list<CloseJob>::iterator job = jobs.begin(); job != jobs.end(); )
+		{
+			if (CloseConnections(job->filter, job->summary, job->batchsize) >= job->batchsize)
+			{
+				// There may be more connections to close.
+				++job;
+				continue;
+			}
+
+			User* src = ServerInstance->FindUUID(job->uuid);
+			if (src)
+				job->summary.Send(src);
+			jobs.erase(job++);
+		}
+		return !jobs.empty();
+	}
+};
+
 class CommandClose : public Command
 {
+ private:
+	CloseTimer timer;
+
+	static bool ParseFilter(const std::string& key, const std::string& value, CloseJob& job)
+	{
+		if (value.empty())
+			return false;
+
+		if (irc::equals(key, "port"))
+		{
+			job.filter.port = ConvToNum<unsigned short>(value);
+			return job.filter.port;
+		}
+
+		if (irc::equals(key, "cidr"))
+		{
+			job.filter.cidr = value;
+			return true;
+		}
+
+		if (irc::equals(key, "age"))
+		{
+			if (!InspIRCd::IsValidDuration(value))
+				return false;
+
+			job.filter.minage = InspIRCd::Duration(value);
+			return true;
+		}
+
+		if (irc::equals(key, "batch"))
+		{
+			job.batchsize = ConvToNum<unsigned long>(value);
+			return job.batchsize;
+		}
+
+		return false;
+	}
+
  public:
 	CommandClose(Module* Creator)
-		: Command(Creator,"CLOSE")
+		: Command(Creator, "CLOSE", 0, 4)
 	{
 		flags_needed = 'o';
+		syntax = "[port=<port>] [cidr=<cidr>] [age=<duration>] [batch=<count>]";
 	}
 
 	CmdResult Handle(User* src, const Params& parameters) CXX11_OVERRIDE
 	{
-		std::map<std::string,int> closed;
+		CloseJob job;
+		job.uuid = src->uuid;
+		job.batchsize = 0;
 
-		const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
-		for (UserManager::LocalList::const_iterator u = list.begin(); u != list.end(); )
+		for (Params::const_iterator param = parameters.begin(); param != parameters.end(); ++param)
 		{
-			// Quitting the user removes it from the list
-			LocalUser* user = *u;
-			++u;
-			if (user->registered != REG_ALL)
+			const std::string::size_type eq = param->find('=');
+			const std::string key = param->substr(0, eq);
+			const std::string value = eq == std::string::npos ? "" : param->substr(eq + 1);
+
+			if (!ParseFilter(key, value, job))
 			{
-				ServerInstance->Users->QuitUser(user, "Closing all unknown connections per request");
-				std::string key = ConvToStr(user->GetIPString())+"."+ConvToStr(user->server_sa.port());
-				closed[key]++;
+				src->WriteNotice("*** CLOSE: Invalid filter: " + *param);
+				return CMD_FAILURE;
 			}
 		}
 
-		int total = 0;
-		for (std::map<std::string,int>::iterator ci = closed.begin(); ci != closed.end(); ci++)
+		if (job.batchsize)
 		{
-			src->WriteNotice("*** Closed " + ConvToStr(ci->second) + " unknown " + (ci->second == 1 ? "connection" : "connections") +
-				" from [" + ci->first + "]");
-			total += ci->second;
+			src->WriteNotice("*** Closing unknown connections in batches of " + ConvToStr(job.batchsize) + " per second");
+			timer.Queue(job);
+			return CMD_SUCCESS;
 		}
-		if (total)
-			src->WriteNotice("*** " + ConvToStr(total) + " unknown " + (total == 1 ? "connection" : "connections") + " closed");
-		else
-			src->WriteNotice("*** No unknown connections found");
 
+		CloseConnections(job.filter, job.summary, SIZE_MAX);
+		job.summary.Send(src);
 		return CMD_SUCCESS;
 	}
 };
@@ -20,7 +20,7 @@
 /// $ModAuthorMail: sadie@witchery.services
 /// $ModConfig: <complete maxsuggestions="10" minlength="3">
 /// $ModDepends: core 3
-/// $ModDesc: Allows clients to automatically complete commands.
+/// $ModDesc: Allows clients to automatically complete commands, nicks, and channels.
 
 
 #include "inspircd.h"
@@ -33,19 +33,125 @@ class CommandComplete : public SplitCommand
 	ClientProtocol::EventProvider evprov;
 	IRCv3::Replies::Fail failrpl;
 
+	// The names of all registered commands in sorted order.
+	std::vector<std::string> commandnames;
+
+	static bool HasPrefix(const std::string& str, const std::string& prefix)
+	{
+		if (str.length() < prefix.length())
+			return false;
+
+		for (size_t idx = 0; idx < prefix.length(); ++idx)
+		{
+			if (national_case_insensitive_map[static_cast<unsigned char>(str[idx])] != national_case_insensitive_map[static_cast<unsigned char>(prefix[idx])])
+				return false;
+		}
+		return true;
+	}
+
+	void RebuildIndex()
+	{
+		commandnames.clear();
+		const CommandParser::CommandMap& commands = ServerInstance->Parser.GetCommands();
+		commandnames.reserve(commands.size());
+		for (CommandParser::CommandMap::const_iterator iter = commands.begin(); iter != commands.end(); ++iter)
+			commandnames.push_back(iter->first);
+		std::sort(commandnames.begin(), commandnames.end());
+		dirty = false;
+	}
+
+	void SendSuggestion(LocalUser* user, const std::string& suggestion, const std::string* syntax)
+	{
+		ClientProtocol::Message msg("COMPLETE");
+		msg.PushParamRef(suggestion);
+		if (syntax)
+			msg.PushParamRef(*syntax);
+		ClientProtocol::Event ev(evprov, msg);
+		user->Send(ev);
+	}
+
+	void CompleteCommand(LocalUser* user, const std::string& partial, size_t max)
+	{
+		if (dirty)
+			RebuildIndex();
+
+		// Command names are always upper case.
+		std::string prefix(partial);
+		std::transform(prefix.begin(), prefix.end(), prefix.begin(), ::toupper);
+
+		size_t sent = 0;
+		std::vector<std::string>::const_iterator iter = std::lower_bound(commandnames.begin(), commandnames.end(), prefix);
+		for (; iter != commandnames.end() && sent < max; ++iter)
+		{
+			if (iter->compare(0, prefix.length(), prefix))
+				break;
+
+			Command* command = ServerInstance->Parser.GetHandler(*iter);
+			if (!command)
+				continue;
+
+			// Don't suggest commands that the user can't use.
+			if (command->flags_needed && (!user->IsModeSet(command->flags_needed) || !user->HasPermission(command->name)))
+				continue;
+
+			SendSuggestion(user, command->name, &command->syntax);
+			sent++;
+		}
+	}
+
+	void CompleteChannel(LocalUser* user, const std::string& partial, size_t max)
+	{
+		size_t sent = 0;
+		for (User::ChanList::const_iterator iter = user->chans.begin(); iter != user->chans.end() && sent < max; ++iter)
+		{
+			const Channel* chan = (*iter)->chan;
+			if (!HasPrefix(chan->name, partial))
+				continue;
+
+			SendSuggestion(user, chan->name, NULL);
+			sent++;
+		}
+	}
+
+	CmdResult CompleteNick(LocalUser* user, const std::string& partial, size_t max, const std::string& channame)
+	{
+		Channel* chan = ServerInstance->FindChan(channame);
+		if (!chan || !chan->HasUser(user))
+		{
+			failrpl.Send(user, this, "INVALID_CHANNEL", channame, "You must be on a channel to complete nicks in it.");
+			return CMD_FAILURE;
+		}
+
+		size_t sent = 0;
+		const Channel::MemberMap& members = chan->GetUsers();
+		for (Channel::MemberMap::const_iterator iter = members.begin(); iter != members.end() && sent < max; ++iter)
+		{
+			const User* member = iter->first;
+			if (!HasPrefix(member->nick, partial))
+				continue;
+
+			SendSuggestion(user, member->nick, NULL);
+			sent++;
+		}
+		return CMD_SUCCESS;
+	}
+
  public:
+	// Whether the command name index needs to be rebuilt.
+	bool dirty;
 	size_t maxsuggestions;
 	size_t minlength;
 
 	CommandComplete(Module* Creator)
-		: SplitCommand(Creator, "COMPLETE", 1)
+		: SplitCommand(Creator, "COMPLETE", 1, 3)
 		, cap(Creator, "labeled-response")
 		, evprov(Creator, "COMPLETE")
 		, failrpl(Creator)
+		, dirty(true)
 	{
 		allow_empty_last_param = false;
 		Penalty = 3;
-		syntax = "<partial-command> [<max>]";
+		syntax = "<partial-command>|<partial-channel>|<partial-nick> [<max>] [<channel>]";
 	}
 
 	CmdResult HandleLocal(LocalUser* user, const Params& parameters) CXX11_OVERRIDE
@@ -59,7 +165,7 @@ class CommandComplete : public SplitCommand
 			return CMD_FAILURE;
 		}
 
-		size_t max = SIZE_MAX;
+		size_t max = maxsuggestions;
 		if (parameters.size() > 1)
 		{
 			max = ConvToNum<size_t>(parameters[1]);
@@ -70,23 +176,13 @@ class CommandComplete : public SplitCommand
 			}
 		}
 
-		size_t maxsent = 0;
-		const CommandParser::CommandMap& commands = ServerInstance->Parser.GetCommands();
-		for (CommandParser::CommandMap::const_iterator iter = commands.begin(); iter != commands.end(); ++iter)
-		{
-			if (!irc::find(iter->first, parameters[0]))
-			{
-				ClientProtocol::Message msg("COMPLETE");
-				msg.PushParamRef(iter->second->name);
-				msg.PushParamRef(iter->second->syntax);
-				ClientProtocol::Event ev(evprov, msg);
-				user->Send(ev);
-				maxsent++;
-			}
+		if (parameters.size() > 2)
+			return CompleteNick(user, parameters[0], max, parameters[2]);
 
-			if (maxsent > maxsuggestions)
-				break;
-		}
+		if (parameters[0][0] == '#')
+			CompleteChannel(user, parameters[0], max);
+		else
+			CompleteCommand(user, parameters[0], max);
 		return CMD_SUCCESS;
 	}
 };
@@ -109,9 +205,19 @@ class ModuleComplete : public Module
 		cmd.minlength = tag->getUInt("minlength", 3, 1);
 	}
 
+	void OnLoadModule(Module* mod) CXX11_OVERRIDE
+	{
+		cmd.dirty = true;
+	}
+
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
+	{
+		cmd.dirty = true;
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
-		return Version("Allows clients to automatically complete commands.");
+		return Version("Allows clients to automatically complete commands, nicks, and channels.");
 	}
 };
 
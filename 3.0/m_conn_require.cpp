@@ -87,6 +87,7 @@ struct UserData
 	bool expectversion;
 	bool selfquit;
 	bool sentcap;
+	bool timedout;
 	bool zapped;
 	std::string firstversionreply;
 	std::string secondversionreply;
@@ -98,6 +99,7 @@ struct UserData
 		, expectversion(false)
 		, selfquit(false)
 		, sentcap(false)
+		, timedout(false)
 		, zapped(false)
 	{
 	}
@@ -122,9 +124,18 @@ struct BanMissing
 	std::string reason;
 };
 
-class ModuleConnRequire : public Module
+// Deadlines at which unregistered users stop being held, keyed by expiry time
+typedef std::multimap<time_t, std::string> DeadlineList;
+
+class ModuleConnRequire
+	: public Module
+	, public Timer
 {
 	SimpleExtItem<UserData> userdata;
+	DeadlineList deadlines;
+
+	// The number of local users we are waiting on replies from
+	size_t tracking;
 
 	std::vector<BadVersion> badversions;
 	std::vector<BanMissing> banmissings;
@@ -144,6 +155,102 @@ class ModuleConnRequire : public Module
 	std::string blockmessage;
 	time_t timeout;
 
+	void StartTracking(LocalUser* user, UserData* ud)
+	{
+		userdata.set(user, ud);
+		deadlines.insert(std::make_pair(ServerInstance->Time() + timeout, user->uuid));
+
+		// Only look at commands whilst there is someone we care about
+		if (!tracking++)
+		{
+			ServerInstance->Modules->Attach(I_OnPreCommand, this);
+			ServerInstance->Modules->Attach(I_OnPostCommand, this);
+		}
+	}
+
+	void StopTracking(LocalUser* user)
+	{
+		if (!userdata.get(user))
+			return;
+
+		userdata.unset(user);
+		if (!--tracking)
+		{
+			ServerInstance->Modules->Detach(I_OnPreCommand, this);
+			ServerInstance->Modules->Detach(I_OnPostCommand, this);
+		}
+	}
+
+	void ReportBlocked(LocalUser* user, UserData* ud)
+	{
+		// Skip proper users
+		if (user->registered == REG_ALL)
+			return;
+
+		// Skip users with a socket level error
+		// This ignores things like port scans, ZNC cert errors, etc.
+		if (!user->eh.getError().empty())
+			return;
+
+		// Skip users that self quit
+		if (ud->selfquit)
+			return;
+
+		// We already disconnected (and possibly banned) these users
+		if (ud->zapped)
+			return;
+
+		// We didn't block any connect classes for this user.
+		if (!ud->ccblocked)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Unregistered user exiting for unknown reasons: %s (%s) [%s]",
+				user->GetFullRealHost().c_str(), user->GetIPString().c_str(), user->GetRealName().c_str());
+			return;
+		}
+
+		// Send them a message if configured
+		if (!blockmessage.empty())
+			user->WriteNotice(blockmessage);
+
+		bool noCap = !ud->sentcap;
+		bool noRpl = (!ctcpstring.empty() && !ud->ctcpreply);
+		bool noVer = (!disableversion && ud->firstversionreply.empty());
+
+		// Check for a match to our BanMissing and then Z-Line
+		for (std::vector<BanMissing>::const_iterator it = banmissings.begin(); it != banmissings.end(); ++it)
+		{
+			const BanMissing& bm = *it;
+
+			// We need to match a <banmissing> entirely. So if we want to match
+			// to missing version and ctcpstring but not cap, we need to skip
+			// any users that are missing cap; and so forth.
+			if (((!bm.cap && noCap) || (bm.cap && !noCap)) ||
+			   ((!bm.ctcp && noRpl) || (bm.ctcp && !noRpl)) ||
+			   ((!bm.version && noVer) || (bm.version && !noVer)))
+				continue;
+
+			SetZLine(user, bm.duration, bm.reason, "banmissing");
+		}
+
+		// Send out a SNOTICE that we likely caused this user to not get through
+		std::string buffer = "Unregistered user exiting: " + user->GetFullRealHost();
+		buffer.append(" (" + std::string(user->GetIPString()) + ") [" + user->GetRealName() + "]");
+		buffer.append(" on port " + ConvToStr(user->server_sa.port()));
+		buffer.append(". Possibly due to missing: ");
+		if (noCap)
+			buffer.append("CAP, ");
+		if (noRpl)
+			buffer.append(ctcpstring + " REPLY, ");
+		if (noVer)
+			buffer.append("VERSION REPLY");
+
+		// Remove trailing ", " if there
+		if (buffer[buffer.length() - 1] == ' ')
+			buffer.erase(buffer.length() - 2, 2);
+
+		ServerInstance->SNO->WriteToSnoMask('u', buffer);
+	}
+
 	void SetZLine(User* user, time_t duration, const std::string& reason, const std::string& from)
 	{
 		XLineFactory* xlf = ServerInstance->XLines->GetFactory("Z");
@@ -177,7 +284,9 @@ class ModuleConnRequire : public Module
 
  public:
 	ModuleConnRequire ()
-		: userdata("userdata", ExtensionItem::EXT_USER, this)
+		: Timer(1, true)
+		, userdata("userdata", ExtensionItem::EXT_USER, this)
+		, tracking(0)
 		, wrapper('\001')
 		, ctcpversion("VERSION")
 		, len_part(ctcpversion.length() + 2)
@@ -191,6 +300,26 @@ class ModuleConnRequire : public Module
 			throw ModuleException("You have m_requirectcp loaded! This module will not work correctly alongside that.");
 
 		ServerInstance->SNO->EnableSnomask('u', "CONN_REQUIRE");
+
+		// These get attached when a user starts registering
+		ServerInstance->Modules->Detach(I_OnPreCommand, this);
+		ServerInstance->Modules->Detach(I_OnPostCommand, this);
+		ServerInstance->Timers.AddTimer(this);
+	}
+
+	bool Tick(time_t currtime) CXX11_OVERRIDE
+	{
+		// Stop holding any users whose timeout has expired
+		DeadlineList::iterator it = deadlines.begin();
+		for (; it != deadlines.end() && it->first <= currtime; ++it)
+		{
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(it->second));
+			UserData* ud = user ? userdata.get(user) : NULL;
+			if (ud)
+				ud->timedout = true;
+		}
+		deadlines.erase(deadlines.begin(), it);
+		return true;
 	}
 
 	void Prioritize() CXX11_OVERRIDE
@@ -276,11 +405,8 @@ class ModuleConnRequire : public Module
 	ModResult OnCheckReady(LocalUser* user) CXX11_OVERRIDE
 	{
 		// Allow user to be held here for up to 'timeout' seconds
-		if (user->signon + timeout <= ServerInstance->Time())
-			return MOD_RES_PASSTHRU;
-
 		UserData* ud = userdata.get(user);
-		if (!ud)
+		if (!ud || ud->timedout)
 			return MOD_RES_PASSTHRU;
 
 		// Hold while waiting for replies
@@ -430,7 +556,7 @@ class ModuleConnRequire : public Module
 	{
 		// Initialize their UserData and send the CTCP request(s)
 		UserData* ud = new UserData;
-		userdata.set(user, ud);
+		StartTracking(user, ud);
 
 		if (!disableversion)
 		{
@@ -451,79 +577,18 @@ class ModuleConnRequire : public Module
 	void OnUserConnect(LocalUser* user) CXX11_OVERRIDE
 	{
 		// If they made it here, they passed; ditch their UserData
-		if (userdata.get(user))
-			userdata.unset(user);
+		StopTracking(user);
 	}
 
 	void OnUserDisconnect(LocalUser* user) CXX11_OVERRIDE
 	{
-		// Skip proper users
-		if (user->registered == REG_ALL)
-			return;
-
-		// Skip users with a socket level error
-		// This ignores things like port scans, ZNC cert errors, etc.
-		if (!user->eh.getError().empty())
-			return;
-
-		// Skip users we don't know about or that self quit
+		// Skip users we don't know about
 		UserData* ud = userdata.get(user);
-		if (!ud || ud->selfquit)
-			return;
-
-		// We already disconnected (and possibly banned) these users
-		if (ud->zapped)
-			return;
-
-		// We didn't block any connect classes for this user.
-		if (!ud->ccblocked)
-		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Unregistered user exiting for unknown reasons: %s (%s) [%s]",
-				user->GetFullRealHost().c_str(), user->GetIPString().c_str(), user->GetRealName().c_str());
+		if (!ud)
 			return;
-		}
-
-		// Send them a message if configured
-		if (!blockmessage.empty())
-			user->WriteNotice(blockmessage);
-
-		bool noCap = !ud->sentcap;
-		bool noRpl = (!ctcpstring.empty() && !ud->ctcpreply);
-		bool noVer = (!disableversion && ud->firstversionreply.empty());
-
-		// Check for a match to our BanMissing and then Z-Line
-		for (std::vector<BanMissing>::const_iterator it = banmissings.begin(); it != banmissings.end(); ++it)
-		{
-			const BanMissing& bm = *it;
-
-			// We need to match a <banmissing> entirely. So if we want to match
-			// to missing version and ctcpstring but not cap, we need to skip
-			// any users that are missing cap; and so forth.
-			if (((!bm.cap && noCap) || (bm.cap && !noCap)) ||
-			   ((!bm.ctcp && noRpl) || (bm.ctcp && !noRpl)) ||
-			   ((!bm.version && noVer) || (bm.version && !noVer)))
-				continue;
 
-			SetZLine(user, bm.duration, bm.reason, "banmissing");
-		}
-
-		// Send out a SNOTICE that we likely caused this user to not get through
-		std::string buffer = "Unregistered user exiting: " + user->GetFullRealHost();
-		buffer.append(" (" + std::string(user->GetIPString()) + ") [" + user->GetRealName() + "]");
-		buffer.append(" on port " + ConvToStr(user->server_sa.port()));
-		buffer.append(". Possibly due to missing: ");
-		if (noCap)
-			buffer.append("CAP, ");
-		if (noRpl)
-			buffer.append(ctcpstring + " REPLY, ");
-		if (noVer)
-			buffer.append("VERSION REPLY");
-
-		// Remove trailing ", " if there
-		if (buffer[buffer.length() - 1] == ' ')
-			buffer.erase(buffer.length() - 2, 2);
-
-		ServerInstance->SNO->WriteToSnoMask('u', buffer);
+		ReportBlocked(user, ud);
+		StopTracking(user);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
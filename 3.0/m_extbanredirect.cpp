@@ -34,13 +34,25 @@ enum
 	ERR_REDIRECT = 690
 };
 
+// A redirect ban which has already been split into its parts.
+struct Redirect
+{
+	std::string target;
+	std::string mask;
+};
+
+// Redirect bans on a channel keyed by the full ban mask.
+typedef std::map<std::string, Redirect, irc::insensitive_swo> RedirectMap;
+
 class BanWatcher : public ModeWatcher
 {
  public:
 	char extbanchar;
+	SimpleExtItem<RedirectMap> redirects;
 
 	BanWatcher(Module* parent)
 		: ModeWatcher(parent, "ban", MODETYPE_CHANNEL)
+		, redirects("extbanredirect-cache", ExtensionItem::EXT_CHANNEL, parent)
 	{
 	}
 
@@ -50,6 +62,70 @@ class BanWatcher : public ModeWatcher
 		return (mask.length() > 2 && mask[0] == extbanchar && mask[1] == ':');
 	}
 
+	static bool Parse(const std::string& mask, Redirect& redirect)
+	{
+		std::string::size_type p = mask.find(':', 2);
+		if (p == std::string::npos)
+			return false;
+
+		redirect.target.assign(mask, 2, p - 2);
+		redirect.mask.assign(mask, p + 1, std::string::npos);
+		return true;
+	}
+
+	const Redirect* Find(Channel* channel, const std::string& mask)
+	{
+		RedirectMap* chanredirects = redirects.get(channel);
+		if (!chanredirects)
+			return NULL;
+
+		RedirectMap::const_iterator iter = chanredirects->find(mask);
+		return iter == chanredirects->end() ? NULL : &iter->second;
+	}
+
+	void Add(Channel* channel, const std::string& mask)
+	{
+		Redirect redirect;
+		if (!Parse(mask, redirect))
+			return;
+
+		RedirectMap* chanredirects = redirects.get(channel);
+		if (!chanredirects)
+		{
+			chanredirects = new RedirectMap;
+			redirects.set(channel, chanredirects);
+		}
+		(*chanredirects)[mask] = redirect;
+	}
+
+	// Checks whether redirecting from source to target would lead back to source.
+	bool IsLoop(Channel* source, const std::string& target)
+	{
+		std::vector<std::string> pending(1, target);
+		std::set<Channel*> seen;
+		while (!pending.empty())
+		{
+			Channel* chan = ServerInstance->FindChan(pending.back());
+			pending.pop_back();
+			if (!chan)
+				continue;
+
+			if (chan == source)
+				return true;
+
+			if (!seen.insert(chan).second)
+				continue;
+
+			const RedirectMap* chanredirects = redirects.get(chan);
+			if (!chanredirects)
+				continue;
+
+			for (RedirectMap::const_iterator iter = chanredirects->begin(); iter != chanredirects->end(); ++iter)
+				pending.push_back(iter->second.target);
+		}
+		return false;
+	}
+
 	bool BeforeMode(User* source, User*, Channel* channel, std::string& param, bool adding) CXX11_OVERRIDE
 	{
 		if (!IS_LOCAL(source) || !channel || !adding)
@@ -58,14 +134,14 @@ class BanWatcher : public ModeWatcher
 		if (!IsExtBanRedirect(param))
 			return true;
 
-		std::string::size_type p = param.find(':', 2);
-		if (p == std::string::npos)
+		Redirect redirect;
+		if (!Parse(param, redirect))
 		{
 			source->WriteNumeric(ERR_REDIRECT, InspIRCd::Format("Extban redirect \"%s\" is invalid. Format: %c:<chan>:<mask>", param.c_str(), extbanchar));
 			return false;
 		}
 
-		std::string targetname(param, 2, p - 2);
+		const std::string& targetname = redirect.target;
 		if (!ServerInstance->IsChannel(targetname))
 		{
 			source->WriteNumeric(ERR_NOSUCHCHANNEL, channel->name, InspIRCd::Format("Invalid channel name in redirection (%s)", targetname.c_str()));
@@ -91,8 +167,34 @@ class BanWatcher : public ModeWatcher
 			return false;
 		}
 
+		if (IsLoop(channel, targetname))
+		{
+			source->WriteNumeric(ERR_REDIRECT, InspIRCd::Format("Extban redirect to %s would create a redirect loop.", targetname.c_str()));
+			return false;
+		}
+
 		return true;
 	}
+
+	void AfterMode(User*, User*, Channel* channel, const std::string& param, bool adding) CXX11_OVERRIDE
+	{
+		if (!channel || !IsExtBanRedirect(param))
+			return;
+
+		if (adding)
+		{
+			Add(channel, param);
+			return;
+		}
+
+		RedirectMap* chanredirects = redirects.get(channel);
+		if (!chanredirects)
+			return;
+
+		chanredirects->erase(param);
+		if (chanredirects->empty())
+			redirects.unset(channel);
+	}
 };
 
 class ModuleExtBanRedirect : public Module
@@ -132,14 +234,22 @@ class ModuleExtBanRedirect : public Module
 		if (!banwatcher.IsExtBanRedirect(mask))
 			return MOD_RES_PASSTHRU;
 
-		std::string::size_type p = mask.find(':', 2);
-		if (p == std::string::npos)
-			return MOD_RES_PASSTHRU;
+		// Masks which weren't seen by the ban watcher (e.g. bans set before we were
+		// loaded or entries from other lists) are parsed without being cached.
+		Redirect parsed;
+		const Redirect* redirect = banwatcher.Find(chan, mask);
+		if (!redirect)
+		{
+			if (!BanWatcher::Parse(mask, parsed))
+				return MOD_RES_PASSTHRU;
+			redirect = &parsed;
+		}
 
-		if (!chan->CheckBan(localuser, mask.substr(p + 1)))
+		if (!chan->CheckBan(localuser, redirect->mask))
 			return MOD_RES_PASSTHRU;
 
-		const std::string targetname = mask.substr(2, p - 2);
+		// Copy the target as joining may cause the ban list to change.
+		const std::string targetname = redirect->target;
 		Channel* const target = ServerInstance->FindChan(targetname);
 		if (target && target->IsModeSet(limitmode))
 		{
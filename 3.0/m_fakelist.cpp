@@ -29,7 +29,79 @@
 /// $ModDesc: Turns /list into a honeypot for newly connected users
 /// $ModConfig: <fakelist waittime="30s" reason="User hit a spam trap" target="#spamtrap" minusers="20" maxusers="50" topic="SPAM TRAP: DO NOT JOIN, YOU WILL BE DISCONNECTED! (try again later for a real reply)" killonjoin="true">
 
-typedef std::vector<std::string> AllowList;
+// An exception which has an ident glob and a CIDR range
+struct CIDRException
+{
+	std::string ident;
+	std::string range;
+};
+
+struct AllowList
+{
+	// Exceptions without any wildcards, lower cased.
+	std::set<std::string> exact;
+
+	// Exceptions which match the IP address of the user against a CIDR range.
+	std::vector<CIDRException> cidr;
+
+	// Everything else.
+	std::vector<std::string> globs;
+
+	void Add(const std::string& mask)
+	{
+		const std::string::size_type at = mask.find('@');
+		const std::string host = (at == std::string::npos) ? mask : mask.substr(at + 1);
+		if (host.find('/') != std::string::npos)
+		{
+			CIDRException ce;
+			ce.ident = (at == std::string::npos) ? "*" : mask.substr(0, at);
+			ce.range = host;
+			cidr.push_back(ce);
+		}
+		else if (mask.find_first_of("*?") == std::string::npos)
+		{
+			std::string lowermask(mask);
+			std::transform(lowermask.begin(), lowermask.end(), lowermask.begin(), ::tolower);
+			exact.insert(lowermask);
+		}
+		else
+		{
+			globs.push_back(mask);
+		}
+	}
+
+	bool Matches(LocalUser* user) const
+	{
+		const std::string userhost = user->MakeHost();
+		if (!exact.empty())
+		{
+			std::string lowerhost(userhost);
+			std::transform(lowerhost.begin(), lowerhost.end(), lowerhost.begin(), ::tolower);
+			if (exact.count(lowerhost))
+				return true;
+		}
+
+		for (std::vector<CIDRException>::const_iterator iter = cidr.begin(); iter != cidr.end(); ++iter)
+		{
+			if (InspIRCd::Match(user->ident, iter->ident, ascii_case_insensitive_map) && InspIRCd::MatchCIDR(user->GetIPString(), iter->range))
+				return true;
+		}
+
+		for (std::vector<std::string>::const_iterator iter = globs.begin(); iter != globs.end(); ++iter)
+		{
+			if (InspIRCd::Match(userhost, *iter, ascii_case_insensitive_map))
+				return true;
+		}
+		return false;
+	}
+
+	void swap(AllowList& other)
+	{
+		exact.swap(other.exact);
+		cidr.swap(other.cidr);
+		globs.swap(other.globs);
+	}
+};
 
 class ModuleFakeList : public Module
 {
@@ -44,7 +116,19 @@ class ModuleFakeList : public Module
 	unsigned int maxUsers;
 	bool killOnJoin;
 
+	// The parts of the fake LIST reply which don't change between requests.
+	Numeric::Numeric liststart;
+	Numeric::Numeric listend;
+
  public:
+	ModuleFakeList()
+		: liststart(RPL_LISTSTART)
+		, listend(RPL_LISTEND)
+	{
+		liststart.push("Channel").push("Users Name");
+		listend.push("End of channel list.");
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Turns /list into a honeypot for newly connected users");
@@ -60,7 +144,7 @@ class ModuleFakeList : public Module
 			std::string host = i->second->getString("exception");
 			if (host.empty())
 				throw ModuleException("<securehost:exception> is a required field at " + i->second->getTagLocation());
-			newallows.push_back(host);
+			newallows.Add(host);
 		}
 
 		ConfigTag* tag = ServerInstance->Config->ConfValue("fakelist");
@@ -91,9 +175,8 @@ class ModuleFakeList : public Module
 		if ((command == "LIST") && (ServerInstance->Time() < (user->signon+WaitTime)) && (!user->IsOper()))
 		{
 			/* Normally wouldnt be allowed here, are they exempt? */
-			for (std::vector<std::string>::iterator x = allowlist.begin(); x != allowlist.end(); x++)
-				if (InspIRCd::Match(user->MakeHost(), *x, ascii_case_insensitive_map))
-					return MOD_RES_PASSTHRU;
+			if (allowlist.Matches(user))
+				return MOD_RES_PASSTHRU;
 
 			const AccountExtItem* ext = GetAccountExtItem();
 			if (exemptregistered && ext && ext->get(user))
@@ -102,9 +185,9 @@ class ModuleFakeList : public Module
 			// Yeah, just give them some fake channels to ponder.
 			unsigned long int userCount = ServerInstance->GenRandomInt(maxUsers-minUsers) + minUsers;
 
-			user->WriteNumeric(RPL_LISTSTART, "Channel", "Users Name");
+			user->WriteNumeric(liststart);
 			user->WriteNumeric(RPL_LIST, targetChannel, userCount, topic);
-			user->WriteNumeric(RPL_LISTEND, "End of channel list.");
+			user->WriteNumeric(listend);
 
 			return MOD_RES_DENY;
 		}
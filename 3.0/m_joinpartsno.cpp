@@ -19,16 +19,109 @@
 #include "inspircd.h"
 
 /// $ModAuthor: Shawn Smith
+/// $ModConfig: <joinpartsno limit="3">
 /// $ModDesc: Sends server notices when a user joins/parts a channel.
 /// $ModDepends: core 3
+// "limit" is the number of joins or parts per channel per second that get their own
+// notice. Any more are summarised once a second. Set it to 0 to disable summaries.
 
-class ModuleJoinPartSNO : public Module
+enum NoticeType
 {
+	NT_LOCAL_JOIN,
+	NT_REMOTE_JOIN,
+	NT_LOCAL_PART,
+	NT_REMOTE_PART,
+	NT_MAX
+};
+
+static const char snomasks[NT_MAX] = { 'e', 'E', 'p', 'P' };
+static const char* const actions[NT_MAX] = { "joined", "joined", "parted", "parted" };
+
+// Counts the notices for a channel within the current second.
+struct NoticeCounts
+{
+	unsigned long sent[NT_MAX];
+	unsigned long suppressed[NT_MAX];
+
+	NoticeCounts()
+	{
+		std::fill(sent, sent + NT_MAX, 0);
+		std::fill(suppressed, suppressed + NT_MAX, 0);
+	}
+};
+
+typedef std::map<std::string, NoticeCounts> NoticeCountMap;
+
+class ModuleJoinPartSNO
+	: public Module
+	, public Timer
+{
+	private:
+		NoticeCountMap counts;
+		unsigned long limit;
+		bool subscribed[NT_MAX];
+		time_t lastcheck;
+
+		bool IsSubscribed(NoticeType type)
+		{
+			// Only look at the opers once per second.
+			if (lastcheck != ServerInstance->Time())
+			{
+				lastcheck = ServerInstance->Time();
+				std::fill(subscribed, subscribed + NT_MAX, false);
+
+				const UserManager::OperList& opers = ServerInstance->Users->all_opers;
+				for (UserManager::OperList::const_iterator i = opers.begin(); i != opers.end(); ++i)
+				{
+					if (!IS_LOCAL(*i))
+						continue;
+
+					for (size_t nt = 0; nt < NT_MAX; ++nt)
+						subscribed[nt] |= (*i)->IsNoticeMaskSet(snomasks[nt]);
+				}
+			}
+			return subscribed[type];
+		}
+
+		void Notify(Membership* memb, NoticeType type)
+		{
+			// Don't build the notice if nobody is going to see it.
+			if (!IsSubscribed(type))
+				return;
+
+			if (limit)
+			{
+				NoticeCounts& chancounts = counts[memb->chan->name];
+				if (chancounts.sent[type] >= limit)
+				{
+					chancounts.suppressed[type]++;
+					return;
+				}
+				chancounts.sent[type]++;
+			}
+
+			ServerInstance->SNO->WriteToSnoMask(snomasks[type], "User %s %s %s", memb->user->GetFullRealHost().c_str(), actions[type], memb->chan->name.c_str());
+		}
+
 	public:
+		ModuleJoinPartSNO()
+			: Timer(1, true)
+			, limit(0)
+			, lastcheck(0)
+		{
+		}
+
 		void init() CXX11_OVERRIDE
 		{
 			ServerInstance->SNO->EnableSnomask('e', "JOIN");
 			ServerInstance->SNO->EnableSnomask('p', "PART");
+			ServerInstance->Timers.AddTimer(this);
+		}
+
+		void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
+		{
+			ConfigTag* tag = ServerInstance->Config->ConfValue("joinpartsno");
+			limit = tag->getUInt("limit", 3);
 		}
 
 		Version GetVersion() CXX11_OVERRIDE
@@ -36,15 +129,31 @@ class ModuleJoinPartSNO : public Module
 			return Version("Creates SNOMask for user joins/parts");
 		}
 
+		bool Tick(time_t) CXX11_OVERRIDE
+		{
+			for (NoticeCountMap::const_iterator i = counts.begin(); i != counts.end(); ++i)
+			{
+				for (size_t nt = 0; nt < NT_MAX; ++nt)
+				{
+					const unsigned long suppressed = i->second.suppressed[nt];
+					if (suppressed)
+						ServerInstance->SNO->WriteToSnoMask(snomasks[nt], "%lu more %s %s %s in the last second", suppressed,
+							suppressed == 1 ? "user" : "users", actions[nt], i->first.c_str());
+				}
+			}
+			counts.clear();
+			return true;
+		}
+
 		void OnUserJoin(Membership* memb, bool sync, bool created, CUList& except) CXX11_OVERRIDE
 		{
 			/* If it's a local user do e, else E. */
-			ServerInstance->SNO->WriteToSnoMask((IS_LOCAL(memb->user) ? 'e' : 'E'), "User %s joined %s", memb->user->GetFullRealHost().c_str(), memb->chan->name.c_str());
+			Notify(memb, IS_LOCAL(memb->user) ? NT_LOCAL_JOIN : NT_REMOTE_JOIN);
 		}
 
 		void OnUserPart(Membership* memb, std::string& partmessage, CUList& except) CXX11_OVERRIDE
 		{
-			ServerInstance->SNO->WriteToSnoMask((IS_LOCAL(memb->user) ? 'p' : 'P'), "User %s parted %s", memb->user->GetFullRealHost().c_str(), memb->chan->name.c_str());
+			Notify(memb, IS_LOCAL(memb->user) ? NT_LOCAL_PART : NT_REMOTE_PART);
 		}
 };
 
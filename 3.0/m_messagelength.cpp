@@ -19,35 +19,59 @@
 
 /// $ModAuthor: Sadie Powell
 /// $ModAuthorMail: sadie@witchery.services
+/// $ModConfig: <messagelength marker="..." maxlines="5">
 /// $ModDesc: Adds a channel mode which limits the length of messages.
 /// $ModDepends: core 3
+// The mode parameter is <max-length>[:<lines>]. If <lines> is more than one then messages
+// from local users which are too long are split into up to that many lines rather than
+// being truncated. If "marker" is set it is appended to messages which have had text
+// removed. The number of lines can not be more than "maxlines" which can be at most 10.
+// Each extra line is charged the same flood penalty as if the user had sent it.
 
 #include "inspircd.h"
 
+// The number of bits the line count is shifted by when stored in the mode extension.
+static const int LINES_SHIFT = 16;
+
 class MessageLengthMode : public ParamMode<MessageLengthMode, LocalIntExt>
 {
  public:
+	unsigned long maxlines;
+
 	MessageLengthMode(Module* Creator)
 		: ParamMode<MessageLengthMode, LocalIntExt>(Creator, "message-length", 'W')
+		, maxlines(5)
 	{
 #if defined INSPIRCD_VERSION_SINCE && INSPIRCD_VERSION_SINCE(3, 2)
-		syntax = "<max-length>";
+		syntax = "<max-length>[:<lines>]";
 #endif
 	}
 
 	ModeAction OnSet(User*, Channel* channel, std::string& parameter)
 	{
-		size_t length = ConvToNum<size_t>(parameter);
+		std::string::size_type sep = parameter.find(':');
+		size_t length = ConvToNum<size_t>(parameter.substr(0, sep));
 		if (length == 0 || length > ServerInstance->Config->Limits.MaxLine)
 			return MODEACTION_DENY;
 
-		this->ext.set(channel, length);
+		size_t lines = 1;
+		if (sep != std::string::npos)
+		{
+			lines = ConvToNum<size_t>(parameter.substr(sep + 1));
+			if (lines == 0 || lines > maxlines)
+				return MODEACTION_DENY;
+		}
+
+		this->ext.set(channel, length | (lines << LINES_SHIFT));
 		return MODEACTION_ALLOW;
 	}
 
 	void SerializeParam(Channel* channel, int n, std::string& out)
 	{
-		out += ConvToStr(n);
+		const int lines = n >> LINES_SHIFT;
+		out += ConvToStr(n & ((1 << LINES_SHIFT) - 1));
+		if (lines > 1)
+			out.append(":").append(ConvToStr(lines));
 	}
 };
 
@@ -55,15 +79,126 @@ class ModuleMessageLength : public Module
 {
  private:
 	MessageLengthMode mode;
+	std::string marker;
+
+	// Lines which still need to be sent after the current message.
+	struct PendingLines
+	{
+		std::string uuid;
+		Channel* channel;
+		char status;
+		std::vector<std::string> lines;
+
+		void clear()
+		{
+			uuid.clear();
+			channel = NULL;
+			status = 0;
+			lines.clear();
+		}
+	} pending;
+
+	static bool IsFormatting(char chr)
+	{
+		switch (chr)
+		{
+			case '\x02': // Bold
+			case '\x03': // Colour
+			case '\x04': // Hex colour
+			case '\x11': // Monospace
+			case '\x16': // Reverse
+			case '\x1D': // Italic
+			case '\x1E': // Strikethrough
+			case '\x1F': // Underline
+				return true;
+		}
+		return false;
+	}
+
+	static bool IsDigit(char chr)
+	{
+		return chr >= '0' && chr <= '9';
+	}
+
+	/** Finds the position at which the text starting at start can be cut so that the
+	 * result is at most max bytes long without splitting a UTF-8 sequence or colour code.
+	 */
+	static size_t FindCut(const std::string& text, size_t start, size_t max)
+	{
+		size_t pos = start + max;
+		if (pos >= text.length())
+			return text.length();
+
+		// Back off over UTF-8 continuation bytes. This can move at most three bytes.
+		while (pos > start && (static_cast<unsigned char>(text[pos]) & 0xC0) == 0x80)
+			pos--;
+
+		// Back off over a colour code which would otherwise be split (\x03NN,NN).
+		for (size_t back = 1; back <= 5 && back <= pos - start; ++back)
+		{
+			if (text[pos - back] != '\x03')
+				continue;
+
+			size_t end = pos - back + 1;
+			for (size_t digits = 0; digits < 2 && end < text.length() && IsDigit(text[end]); ++digits)
+				end++;
+			if (end > pos - back + 1 && end + 1 < text.length() && text[end] == ',' && IsDigit(text[end + 1]))
+			{
+				end += 2;
+				if (end < text.length() && IsDigit(text[end]))
+					end++;
+			}
+
+			if (end > pos)
+				pos -= back;
+			break;
+		}
+
+		// If there's a space in the second half of the line split there instead.
+		std::string::size_type space = text.rfind(' ', pos);
+		if (space != std::string::npos && space > start + max / 2)
+			pos = space;
+
+		// If the text is not splittable then cut it where we were asked to.
+		return pos > start ? pos : start + max;
+	}
+
+	/** Cuts text to fit within the limits and returns the number of bytes consumed. */
+	size_t Cut(const std::string& text, size_t start, size_t length, bool last, std::string& out)
+	{
+		// Leave room to close any formatting and for the continuation marker.
+		size_t reserve = 1 + (last ? marker.length() : 0);
+		size_t end = FindCut(text, start, length > reserve ? length - reserve : length);
+		out.assign(text, start, end - start);
+
+		if (std::find_if(out.begin(), out.end(), IsFormatting) != out.end())
+			out.push_back('\x0F');
+		if (last && end < text.length())
+			out.append(marker);
+
+		// Skip the space we split on.
+		if (end < text.length() && text[end] == ' ')
+			end++;
+		return end;
+	}
 
  public:
 	ModuleMessageLength()
 		: mode(this)
 	{
+		pending.clear();
+	}
+
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("messagelength");
+		marker = tag->getString("marker");
+		mode.maxlines = tag->getUInt("maxlines", 5, 1, 10);
 	}
 
 	ModResult OnUserPreMessage(User* user, const MessageTarget& target, MessageDetails& details) CXX11_OVERRIDE
 	{
+		pending.clear();
 		if (target.type != MessageTarget::TYPE_CHANNEL)
 			return MOD_RES_PASSTHRU;
 
@@ -71,13 +206,77 @@ class ModuleMessageLength : public Module
 		if (!channel->IsModeSet(&mode))
 			return MOD_RES_PASSTHRU;
 
-		unsigned int msglength = mode.ext.get(channel);
-		if (details.text.length() > msglength)
-			details.text.resize(msglength);
+		const unsigned int value = mode.ext.get(channel);
+		const size_t msglength = value & ((1 << LINES_SHIFT) - 1);
+		if (details.text.length() <= msglength)
+			return MOD_RES_PASSTHRU;
+
+		// Only messages from local users can be split and CTCPs must never be.
+		size_t lines = value >> LINES_SHIFT;
+		if (!IS_LOCAL(user) || details.IsCTCP())
+			lines = 1;
 
+		const std::string text(details.text);
+		size_t pos = Cut(text, 0, msglength, lines <= 1, details.text);
+		for (size_t line = 2; line <= lines && pos < text.length(); ++line)
+		{
+			pending.lines.push_back(std::string());
+			pos = Cut(text, pos, msglength, line == lines, pending.lines.back());
+		}
+
+		if (!pending.lines.empty())
+		{
+			pending.uuid = user->uuid;
+			pending.channel = channel;
+			pending.status = target.status;
+		}
 		return MOD_RES_PASSTHRU;
 	}
 
+	void OnUserPostMessage(User* user, const MessageTarget& target, const MessageDetails& details) CXX11_OVERRIDE
+	{
+		if (pending.lines.empty())
+			return;
+
+		// Only send the lines which were split from this message.
+		if (target.type != MessageTarget::TYPE_CHANNEL || pending.uuid != user->uuid
+			|| pending.channel != target.Get<Channel>() || pending.status != target.status)
+		{
+			pending.clear();
+			return;
+		}
+
+		// Send the rest of the lines as if the user had sent them so they are
+		// checked and routed the same way as the first line.
+		std::vector<std::string> lines;
+		lines.swap(pending.lines);
+		pending.clear();
+
+		std::string targetname(target.Get<Channel>()->name);
+		if (target.status)
+			targetname.insert(targetname.begin(), target.status);
+
+		const std::string command(details.type == MSG_NOTICE ? "NOTICE" : "PRIVMSG");
+		Command* handler = ServerInstance->Parser.GetHandler(command);
+		LocalUser* localuser = IS_LOCAL(user);
+		for (std::vector<std::string>::const_iterator iter = lines.begin(); iter != lines.end(); ++iter)
+		{
+			// CallHandler does not apply the flood penalty so charge it here.
+			if (handler && localuser && !localuser->HasPrivPermission("users/flood/no-throttle"))
+				localuser->CommandFloodPenalty += handler->Penalty * 1000;
+
+			CommandBase::Params params;
+			params.push_back(targetname);
+			params.push_back(*iter);
+			ServerInstance->Parser.CallHandler(command, params, user);
+		}
+	}
+
+	void OnUserMessageBlocked(User* user, const MessageTarget& target, const MessageDetails& details) CXX11_OVERRIDE
+	{
+		pending.clear();
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Adds a channel mode which limits the length of messages.", VF_COMMON);
@@ -85,4 +284,3 @@ class ModuleMessageLength : public Module
 };
 
 MODULE_INIT(ModuleMessageLength)
-
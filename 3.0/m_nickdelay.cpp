@@ -18,31 +18,114 @@
 
 /// $ModAuthor: Attila Molnar
 /// $ModAuthorMail: attilamolnar@hush.com
-/// $ModConfig: <nickdelay delay="10" hint="true">
+/// $ModConfig: <nickdelay delay="10" hint="true" changes="0" window="60" ipchanges="0" ipwindow="60" ipv4range="24" ipv6range="64">
 /// $ModDepends: core 3
 /// $ModDesc: Enforces a delay between nick changes per user
 // If you want opers to be exempt, add the priv 'users/ignore-nickdelay' to their oper class.
+// If "changes" is set then users may only change their nick that many times per "window".
+// If "ipchanges" is set then all users within an IP range ("ipv4range" or "ipv6range" bits)
+// may only change their nick that many times per "ipwindow" between them.
 
 
 #include "inspircd.h"
 
+/** A token bucket which is implemented as a generic cell rate algorithm so that the
+ * state for each user or IP range is just the time at which the bucket will be full.
+ */
+struct RateLimit
+{
+	// The number of seconds it takes for a change to be refunded.
+	time_t interval;
+
+	// The number of seconds worth of changes which can be made at once.
+	time_t burst;
+
+	RateLimit()
+		: interval(0)
+		, burst(0)
+	{
+	}
+
+	void Configure(unsigned long changes, unsigned long window)
+	{
+		if (!changes)
+		{
+			interval = burst = 0;
+			return;
+		}
+
+		interval = std::max<time_t>(window / changes, 1);
+		burst = interval * (changes - 1);
+	}
+
+	bool IsEnabled() const
+	{
+		return interval;
+	}
+
+	/** Returns how long a user needs to wait before they can change their nick. */
+	time_t GetWait(time_t full) const
+	{
+		const time_t now = ServerInstance->Time();
+		const time_t used = std::max(full, now) - now;
+		return used > burst ? used - burst : 0;
+	}
+
+	/** Returns the new state after a nick change. */
+	time_t Consume(time_t full) const
+	{
+		return std::max(full, ServerInstance->Time()) + interval;
+	}
+};
+
+typedef std::map<std::string, time_t> RangeMap;
+
 class ModuleNickDelay : public Module
 {
 	LocalIntExt lastchanged;
+	LocalIntExt userbucket;
+	RangeMap rangebuckets;
+	RateLimit userlimit;
+	RateLimit rangelimit;
 	unsigned int delay;
+	unsigned char ipv4range;
+	unsigned char ipv6range;
 	bool hint;
 
+	std::string GetRange(LocalUser* user)
+	{
+		const unsigned char range = user->client_sa.family() == AF_INET6 ? ipv6range : ipv4range;
+		return irc::sockets::cidr_mask(user->client_sa, range).str();
+	}
+
  public:
 	ModuleNickDelay()
 		: lastchanged("nickdelay", ExtensionItem::EXT_USER, this)
+		, userbucket("nickdelay-bucket", ExtensionItem::EXT_USER, this)
 	{
 	}
 
 	void OnUserPostNick(User* user, const std::string& oldnick) CXX11_OVERRIDE
 	{
 		// Ignore remote users and nick changes to uuid
-		if ((IS_LOCAL(user)) && (user->nick != user->uuid))
-			lastchanged.set(user, ServerInstance->Time());
+		LocalUser* luser = IS_LOCAL(user);
+		if (!luser || luser->nick == luser->uuid)
+			return;
+
+		lastchanged.set(luser, ServerInstance->Time());
+
+		// Nicks set while registering don't count towards the rate limits.
+		if (luser->registered != REG_ALL)
+			return;
+
+		if (userlimit.IsEnabled())
+			userbucket.set(luser, userlimit.Consume(userbucket.get(luser)));
+
+		if (rangelimit.IsEnabled())
+		{
+			time_t& full = rangebuckets[GetRange(luser)];
+			full = rangelimit.Consume(full);
+		}
 	}
 
 	ModResult OnUserPreNick(LocalUser* user, const std::string& newnick) CXX11_OVERRIDE
@@ -52,6 +135,19 @@ class ModuleNickDelay : public Module
 
 		time_t lastchange = lastchanged.get(user);
 		time_t wait = lastchange + delay - ServerInstance->Time();
+		if (user->registered == REG_ALL)
+		{
+			if (userlimit.IsEnabled())
+				wait = std::max(wait, userlimit.GetWait(userbucket.get(user)));
+
+			if (rangelimit.IsEnabled())
+			{
+				RangeMap::const_iterator iter = rangebuckets.find(GetRange(user));
+				if (iter != rangebuckets.end())
+					wait = std::max(wait, rangelimit.GetWait(iter->second));
+			}
+		}
+
 		if (wait > 0)
 		{
 			if (hint)
@@ -72,11 +168,27 @@ class ModuleNickDelay : public Module
 		return MOD_RES_PASSTHRU;
 	}
 
+	void OnBackgroundTimer(time_t curtime) CXX11_OVERRIDE
+	{
+		// Ranges with a full bucket are the same as ranges without one.
+		for (RangeMap::iterator iter = rangebuckets.begin(); iter != rangebuckets.end(); )
+		{
+			if (iter->second <= curtime)
+				rangebuckets.erase(iter++);
+			else
+				++iter;
+		}
+	}
+
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("nickdelay");
 		delay = tag->getUInt("delay", 10, 1);
 		hint = tag->getBool("hint", true);
+		userlimit.Configure(tag->getUInt("changes", 0), tag->getDuration("window", 60, 1));
+		rangelimit.Configure(tag->getUInt("ipchanges", 0), tag->getDuration("ipwindow", 60, 1));
+		ipv4range = tag->getUInt("ipv4range", 24, 1, 32);
+		ipv6range = tag->getUInt("ipv6range", 64, 1, 128);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
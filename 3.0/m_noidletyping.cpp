@@ -25,13 +25,34 @@
 #include "inspircd.h"
 #include "modules/ctctags.h"
 
+// The number of one second slots in the idle timing wheel.
+static const size_t WHEEL_SIZE = 64;
+
 class ModuleNoIdleTyping
 	: public Module
 	, public CTCTags::EventListener
+	, public Timer
 {
  private:
+	typedef std::set<LocalUser*> IdleUsers;
+	typedef std::vector<std::string> WheelSlot;
+
 	unsigned long duration;
 
+	// Local users who were idle the last time they were checked.
+	IdleUsers idleusers;
+
+	// The UUIDs of local users who need to be checked for idleness, bucketed
+	// by the second at which they are next expected to become idle.
+	WheelSlot wheel[WHEEL_SIZE];
+
+	// The last time that the wheel was advanced to.
+	time_t wheeltime;
+
+	// Whether the users who were connected when the module was loaded have
+	// been scheduled yet.
+	bool scheduled;
+
 	bool IsIdle(User* source)
 	{
 		LocalUser* lsource = IS_LOCAL(source);
@@ -45,13 +66,71 @@ class ModuleNoIdleTyping
 		return diff > duration;
 	}
 
-	ModResult BuildChannelExempts(User* source, Channel* channel, CTCTags::TagMessageDetails& details)
+	void Schedule(LocalUser* user)
+	{
+		time_t deadline = user->idle_lastmsg + duration + 1;
+		if (deadline <= ServerInstance->Time())
+			deadline = ServerInstance->Time() + 1;
+		wheel[deadline % WHEEL_SIZE].push_back(user->uuid);
+	}
+
+	void CheckSlot(WheelSlot& slot)
+	{
+		WheelSlot pending;
+		pending.swap(slot);
+		for (WheelSlot::const_iterator iter = pending.begin(); iter != pending.end(); ++iter)
+		{
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(*iter));
+			if (!user || user->quitting)
+				continue;
+
+			if (IsIdle(user))
+				idleusers.insert(user);
+			else
+				Schedule(user);
+		}
+	}
+
+	ModResult BuildChannelExempts(Channel* channel, CTCTags::TagMessageDetails& details)
 	{
+		// Walk whichever of the idle users and the channel members is smaller.
 		const Channel::MemberMap& members = channel->GetUsers();
-		for (Channel::MemberMap::const_iterator member = members.begin(); member != members.end(); ++member)
+		if (idleusers.size() < members.size())
+		{
+			for (IdleUsers::iterator iter = idleusers.begin(); iter != idleusers.end(); )
+			{
+				LocalUser* user = *iter;
+				if (!IsIdle(user))
+				{
+					// The user has spoken since they were last checked.
+					idleusers.erase(iter++);
+					Schedule(user);
+					continue;
+				}
+
+				if (channel->HasUser(user))
+					details.exemptions.insert(user);
+				++iter;
+			}
+		}
+		else
 		{
-			if (IsIdle(source))
-				details.exemptions.insert(member->first);
+			for (Channel::MemberMap::const_iterator member = members.begin(); member != members.end(); ++member)
+			{
+				LocalUser* user = IS_LOCAL(member->first);
+				if (!user)
+					continue;
+
+				if (!IsIdle(user))
+				{
+					// The user may have spoken since they were last checked.
+					if (idleusers.erase(user))
+						Schedule(user);
+					continue;
+				}
+
+				details.exemptions.insert(user);
+			}
 		}
 		return MOD_RES_PASSTHRU;
 	}
@@ -59,13 +138,57 @@ class ModuleNoIdleTyping
  public:
 	ModuleNoIdleTyping()
 		: CTCTags::EventListener(this, 200)
+		, Timer(1, true)
+		, duration(60*10)
+		, wheeltime(ServerInstance->Time())
+		, scheduled(false)
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Timers.AddTimer(this);
+	}
+
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("noidletyping");
 		duration = tag->getDuration("duration", 60*10, 60);
+		if (scheduled)
+			return;
+
+		// This has to wait until the duration is known.
+		const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+		{
+			LocalUser* user = *iter;
+			if (user->registered == REG_ALL)
+				Schedule(user);
+		}
+		scheduled = true;
+	}
+
+	bool Tick(time_t currtime) CXX11_OVERRIDE
+	{
+		// If we have fallen a whole rotation behind every slot needs checking.
+		if (currtime - wheeltime > static_cast<time_t>(WHEEL_SIZE))
+			wheeltime = currtime - WHEEL_SIZE;
+
+		while (wheeltime < currtime)
+			CheckSlot(wheel[++wheeltime % WHEEL_SIZE]);
+		return true;
+	}
+
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		LocalUser* luser = IS_LOCAL(user);
+		if (luser)
+			Schedule(luser);
+	}
+
+	void OnUserDisconnect(LocalUser* user) CXX11_OVERRIDE
+	{
+		idleusers.erase(user);
 	}
 
 	ModResult OnUserPreTagMessage(User* user, const MessageTarget& target, CTCTags::TagMessageDetails& details) CXX11_OVERRIDE
@@ -78,7 +201,7 @@ class ModuleNoIdleTyping
 		switch (target.type)
 		{
 			case MessageTarget::TYPE_CHANNEL:
-				return BuildChannelExempts(user, target.Get<Channel>(), details);
+				return BuildChannelExempts(target.Get<Channel>(), details);
 
 			case MessageTarget::TYPE_USER:
 				return IsIdle(target.Get<User>()) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
@@ -28,7 +28,7 @@
 /// $ModAuthor: Sadie Powell
 /// $ModAuthorMail: sadie@witchery.services
 /// $ModDesc: Provides support for QR code generation via the /QRCODE command.
-/// $ModConfig: <qrcode blockchar=" " darkcolour="black" lightcolour="white">
+/// $ModConfig: <qrcode blockchar=" " darkcolour="black" lightcolour="white" halfblock="yes" cachesize="32">
 /// $ModDepends: core 3
 
 
@@ -82,10 +82,10 @@ class QRCode
 			return false;
 
 		size_t width = static_cast<size_t>(code->width);
-		if (x > width || y > width)
+		if (x >= width || y >= width)
 			return false;
 
-		unsigned char* chr = code->data + (x * width) + y;
+		unsigned char* chr = code->data + (y * width) + x;
 		return *chr & 0x1;
 	}
 
@@ -100,6 +100,59 @@ class QRCode
 	}
 };
 
+typedef std::vector<std::string> RenderedCode;
+
+// Keeps the most recently rendered QR codes so popular URLs are only encoded once.
+class RenderCache
+{
+ private:
+	typedef std::list<std::pair<std::string, RenderedCode> > EntryList;
+	typedef std::map<std::string, EntryList::iterator> EntryMap;
+
+	// Most recently used entries are at the front.
+	EntryList entries;
+	EntryMap index;
+
+ public:
+	size_t maxsize;
+
+	RenderCache()
+		: maxsize(32)
+	{
+	}
+
+	const RenderedCode* Get(const std::string& key)
+	{
+		EntryMap::iterator iter = index.find(key);
+		if (iter == index.end())
+			return NULL;
+
+		entries.splice(entries.begin(), entries, iter->second);
+		return &iter->second->second;
+	}
+
+	const RenderedCode& Add(const std::string& key, RenderedCode& lines)
+	{
+		while (!entries.empty() && entries.size() >= maxsize)
+		{
+			index.erase(entries.back().first);
+			entries.pop_back();
+		}
+
+		entries.push_front(std::make_pair(key, RenderedCode()));
+		entries.front().second.swap(lines);
+		if (maxsize)
+			index[key] = entries.begin();
+		return entries.front().second;
+	}
+
+	void Clear()
+	{
+		entries.clear();
+		index.clear();
+	}
+};
+
 class CommandQRCode : public SplitCommand
 {
 private:
@@ -107,16 +160,93 @@ private:
 	ChanModeReference privatemode;
 	ChanModeReference secretmode;
 
-	std::string FormatPixel(bool dark)
+	// The buffer that lines are built in before being copied to the output.
+	std::string linebuf;
+
+	// The colour codes which are currently active in linebuf.
+	const std::string* lastfg;
+	const std::string* lastbg;
+
+	void AppendColour(const std::string& fg, const std::string& bg)
 	{
-		std::string buffer;
-		buffer.append("\x3");
-		buffer.append(dark ? darkcolour : lightcolour);
-		buffer.append(",");
-		buffer.append(dark ? darkcolour : lightcolour);
-		buffer.append(blockchar);
-		buffer.append(blockchar);
-		return buffer;
+		// Only send a colour code if the colours have actually changed.
+		if (lastfg == &fg && lastbg == &bg)
+			return;
+
+		linebuf.append("\x3");
+		linebuf.append(fg);
+		linebuf.push_back(',');
+		linebuf.append(bg);
+		lastfg = &fg;
+		lastbg = &bg;
+	}
+
+	void StartLine()
+	{
+		linebuf.clear();
+		lastfg = lastbg = NULL;
+	}
+
+	// Gets a pixel with a one pixel light border around the code.
+	bool IsDark(const QRCode& code, size_t x, size_t y)
+	{
+		return x && y && code.GetPixel(x - 1, y - 1);
+	}
+
+	void RenderFullBlock(const QRCode& code, RenderedCode& lines)
+	{
+		const size_t size = code.GetSize() + 2;
+		for (size_t y = 0; y < size; ++y)
+		{
+			StartLine();
+			for (size_t x = 0; x < size; ++x)
+			{
+				const std::string& colour = IsDark(code, x, y) ? darkcolour : lightcolour;
+				AppendColour(colour, colour);
+				linebuf.append(blockchar);
+				linebuf.append(blockchar);
+			}
+			lines.push_back(linebuf);
+		}
+	}
+
+	void RenderHalfBlock(const QRCode& code, RenderedCode& lines)
+	{
+		// Each line holds two rows of pixels: the foreground colour of an upper
+		// half block is the top pixel and the background colour is the bottom one.
+		const size_t size = code.GetSize() + 2;
+		for (size_t y = 0; y < size; y += 2)
+		{
+			StartLine();
+			for (size_t x = 0; x < size; ++x)
+			{
+				const std::string& top = IsDark(code, x, y) ? darkcolour : lightcolour;
+				const std::string& bottom = IsDark(code, x, y + 1) ? darkcolour : lightcolour;
+				AppendColour(top, bottom);
+				linebuf.append("\xE2\x96\x80");
+			}
+			lines.push_back(linebuf);
+		}
+	}
+
+	const RenderedCode* Render(const std::string& url, int& error)
+	{
+		// The cache is cleared on rehash so the settings don't need to be part of the key.
+		const RenderedCode* cached = cache.Get(url);
+		if (cached)
+			return cached;
+
+		QRCode code(url);
+		error = code.GetError();
+		if (error)
+			return NULL;
+
+		RenderedCode lines;
+		if (halfblock)
+			RenderHalfBlock(code, lines);
+		else
+			RenderFullBlock(code, lines);
+		return &cache.Add(url, lines);
 	}
 
 	std::string URLEncode(const std::string& data)
@@ -149,12 +279,17 @@ private:
 	std::string blockchar;
 	std::string darkcolour;
 	std::string lightcolour;
+	bool halfblock;
+	RenderCache cache;
 
 	CommandQRCode(Module* Creator)
 		: SplitCommand(Creator, "QRCODE", 0, 1)
 		, keymode(Creator, "key")
 		, privatemode(Creator, "private")
 		, secretmode(Creator, "secret")
+		, lastfg(NULL)
+		, lastbg(NULL)
+		, halfblock(true)
 	{
 		allow_empty_last_param = false;
 	}
@@ -204,10 +339,11 @@ private:
 			url.insert(0, source->server_sa.addr());
 		url.insert(0, ssliohook ? "ircs://" : "irc://");
 
-		QRCode code(url);
-		if (code.GetError())
+		int error = 0;
+		const RenderedCode* lines = Render(url, error);
+		if (!lines)
 		{
-			source->WriteNotice(InspIRCd::Format("QR generation failed: %s", strerror(code.GetError())));
+			source->WriteNotice(InspIRCd::Format("QR generation failed: %s", strerror(error)));
 			return CMD_FAILURE;
 		}
 
@@ -218,22 +354,9 @@ private:
 			WriteMessage(source, "Use this QR code to connect to " + ServerInstance->Config->Network + " and chat with " + parameters[0] + ":");
 
 
-		// Format the QR code and send it to the user.
-		std::string border;
-		for (size_t c = 0; c < code.GetSize() + 2; ++c)
-			border.append(FormatPixel(false));
-
-		WriteMessage(source, border);
-		for (size_t y = 0; y < code.GetSize(); ++y)
-		{
-			std::string row(FormatPixel(false));
-			for (size_t x = 0; x < code.GetSize(); ++x)
-				row.append(FormatPixel(code.GetPixel(x, y)));
-			row.append(FormatPixel(false));
-
-			WriteMessage(source, row);
-		}
-		WriteMessage(source, border);
+		// Send the QR code to the user.
+		for (RenderedCode::const_iterator iter = lines->begin(); iter != lines->end(); ++iter)
+			WriteMessage(source, *iter);
 
 		return CMD_SUCCESS;
 	}
@@ -317,6 +440,9 @@ class ModuleQRCode : public Module
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("qrcode");
 
+		// Whether to draw two rows of pixels per line using ▀ instead of using blockchar.
+		bool halfblock = tag->getBool("halfblock", true);
+
 		// You can use █ if your client sucks at fixed-width formatting.
 		std::string blockchar = tag->getString("blockchar", " ");
 		if (blockchar.empty())
@@ -330,6 +456,11 @@ class ModuleQRCode : public Module
 		cmd.blockchar.swap(blockchar);
 		cmd.darkcolour.swap(darkcolour);
 		cmd.lightcolour.swap(lightcolour);
+		cmd.halfblock = halfblock;
+
+		// The cached codes were rendered with the old settings.
+		cmd.cache.Clear();
+		cmd.cache.maxsize = tag->getUInt("cachesize", 32, 0, 1000);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -23,23 +23,106 @@
 
 /// $ModAuthor: genius3000
 /// $ModAuthorMail: genius3000@g3k.solutions
-/// $ModConfig: <randomnotice file="randomnotices.txt" interval="30m" prefix="" suffix="">
+/// $ModConfig: <randomnotice file="randomnotices.txt" interval="30m" prefix="" suffix="" slicesize="1000">
 /// $ModDepends: core 3
 /// $ModDesc: Send a random notice (quote) from a file to all users at a set interval.
 // "file" needs to be a text file with each 'notice' on a new line
 // "interval" is a time-string (1y7d8h6m3s format)
+// "slicesize" is the number of users the notice is sent to per second
+// Notices are sent from the server to "$<servername>" rather than to each user's nick.
 
 
 #include "inspircd.h"
 
+/** Sends a message to all local users a slice at a time. The message is built once
+ * so it is only serialised once per protocol rather than once per user.
+ */
+class BroadcastTimer : public Timer
+{
+ private:
+	ClientProtocol::Messages::Privmsg* message;
+	std::vector<std::string> pending;
+	bool active;
+
+	/** Sends the next slice and returns true if there are more to send. */
+	bool SendSlice()
+	{
+		size_t sent = 0;
+		while (!pending.empty() && sent < slicesize)
+		{
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(pending.back()));
+			pending.pop_back();
+			if (!user || user->quitting)
+				continue;
+
+			user->Send(ServerInstance->GetRFCEvents().privmsg, *message);
+			sent++;
+		}
+		return !pending.empty();
+	}
+
+ public:
+	size_t slicesize;
+
+	BroadcastTimer()
+		: Timer(1, true)
+		, message(NULL)
+		, active(false)
+		, slicesize(1000)
+	{
+	}
+
+	~BroadcastTimer()
+	{
+		delete message;
+	}
+
+	void Send(const std::string& text)
+	{
+		// Any users who have not received the previous message yet will just miss it.
+		// The target is the server mask so the same message can be sent to everyone.
+		delete message;
+		const std::string& servername = ServerInstance->Config->ServerName;
+		message = new ClientProtocol::Messages::Privmsg(servername, "$" + servername, text, MSG_NOTICE);
+
+		pending.clear();
+		const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator i = users.begin(); i != users.end(); ++i)
+		{
+			LocalUser* user = *i;
+			if (user->registered == REG_ALL)
+				pending.push_back(user->uuid);
+		}
+
+		if (SendSlice() && !active)
+		{
+			active = true;
+			ServerInstance->Timers.AddTimer(this);
+		}
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE
+	{
+		active = SendSlice();
+		return active;
+	}
+};
+
 class RandomNoticeTimer : public Timer
 {
+ private:
+	BroadcastTimer& broadcast;
+
  public:
 	std::vector<std::string> notices;
 	std::string prefix;
 	std::string suffix;
 
-	RandomNoticeTimer() : Timer(1800, true) { }
+	RandomNoticeTimer(BroadcastTimer& Broadcast)
+		: Timer(1800, true)
+		, broadcast(Broadcast)
+	{
+	}
 
 	bool Tick(time_t) CXX11_OVERRIDE
 	{
@@ -49,30 +132,25 @@ class RandomNoticeTimer : public Timer
 		unsigned long random = ServerInstance->GenRandomInt(notices.size());
 		const std::string& notice = notices[random];
 
-		for (UserManager::LocalList::const_iterator i = ServerInstance->Users.GetLocalUsers().begin(); i != ServerInstance->Users.GetLocalUsers().end(); ++i)
-		{
-			LocalUser* user = *i;
-
-			if (user->registered == REG_ALL)
-				user->WriteNotice(prefix + notice + suffix);
-		}
-
+		broadcast.Send(prefix + notice + suffix);
 		return true;
 	}
 };
 
 class ModuleRandomNotice : public Module
 {
+	BroadcastTimer broadcast;
 	RandomNoticeTimer* timer;
 
  public:
 	ModuleRandomNotice()
 	{
-		timer = new RandomNoticeTimer();
+		timer = new RandomNoticeTimer(broadcast);
 	}
 
 	~ModuleRandomNotice()
 	{
+		ServerInstance->Timers.DelTimer(&broadcast);
 		ServerInstance->Timers.DelTimer(timer);
 	}
 
@@ -88,6 +166,7 @@ class ModuleRandomNotice : public Module
 		timer->notices = reader.GetVector();
 		timer->prefix = tag->getString("prefix");
 		timer->suffix = tag->getString("suffix");
+		broadcast.slicesize = tag->getUInt("slicesize", 1000, 1);
 		unsigned long interval = tag->getDuration("interval", 1800, 60, 31536000);
 		if (timer->GetInterval() != interval)
 			timer->SetInterval(interval);
@@ -20,12 +20,15 @@
 /// $ModAuthorMail: james@overdrivenetworks.com
 /// $ModDepends: core 3
 /// $ModDesc: Provides the RELAYMSG command & draft/relaymsg capability for stateless bridging
-/// $ModConfig: <relaymsg separators="/" ident="relay" host="relay.example.com">
+/// $ModConfig: <relaymsg separators="/" ident="relay" host="relay.example.com" linesep="">
 //  The "host" option defaults to the local server hostname if not set.
+//  If "linesep" is set then the text of a RELAYMSG is split on it and the lines are
+//  delivered as a single IRCv3 batch. This should be the same on all servers.
 
 #include "inspircd.h"
 #include "modules/cap.h"
 #include "modules/ircv3.h"
+#include "modules/ircv3_batch.h"
 
 enum
 {
@@ -67,6 +70,57 @@ public:
     }
 };
 
+// Caches the fake n!u@h sources of recently relayed nicks
+class FakeSourceCache
+{
+private:
+    typedef std::list<std::pair<std::string, std::string> > EntryList;
+    typedef std::map<std::string, EntryList::iterator> EntryMap;
+
+    // Most recently used entries are at the front.
+    EntryList entries;
+    EntryMap index;
+    size_t maxsize;
+
+public:
+    FakeSourceCache(size_t MaxSize)
+        : maxsize(MaxSize)
+    {
+    }
+
+    const std::string& Get(const std::string& nick, const std::string& ident, const std::string& host)
+    {
+        EntryMap::iterator iter = index.find(nick);
+        if (iter != index.end())
+        {
+            entries.splice(entries.begin(), entries, iter->second);
+            return iter->second->second;
+        }
+
+        if (entries.size() >= maxsize)
+        {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+
+        std::string source;
+        source.reserve(nick.length() + ident.length() + host.length() + 2);
+        source.append(nick).push_back('!');
+        source.append(ident).push_back('@');
+        source.append(host);
+
+        entries.push_front(std::make_pair(nick, source));
+        index[nick] = entries.begin();
+        return entries.front().second;
+    }
+
+    void Clear()
+    {
+        entries.clear();
+        index.clear();
+    }
+};
+
 // Handler for the RELAYMSG command (users and servers)
 class CommandRelayMsg : public Command
 {
@@ -74,22 +128,72 @@ private:
     RelayMsgCap& cap;
     RelayMsgCapTag& captag;
 
+    IRCv3::Batch::API batchmanager;
+    FakeSourceCache sourcecache;
+
+    void SendLines(Channel* channel, const std::string& source, const std::string& text, const ClientProtocol::TagMap& tags)
+    {
+        std::string::size_type start = 0;
+        std::string::size_type end = linesep.empty() ? std::string::npos : text.find(linesep);
+        if (end == std::string::npos)
+        {
+            // Only one line, no need for a batch.
+            SendLine(channel, source, text, tags, NULL);
+            return;
+        }
+
+        IRCv3::Batch::Batch batch("draft/relaymsg");
+        batch.AddParam(channel->name);
+        if (batchmanager)
+            batchmanager->Start(batch);
+
+        std::string line;
+        for (;;)
+        {
+            line.assign(text, start, end == std::string::npos ? std::string::npos : end - start);
+            if (!line.empty())
+                SendLine(channel, source, line, tags, batchmanager ? &batch : NULL);
+
+            if (end == std::string::npos)
+                break;
+
+            start = end + linesep.length();
+            end = text.find(linesep, start);
+        }
+
+        if (batchmanager)
+            batchmanager->End(batch);
+    }
+
+    void SendLine(Channel* channel, const std::string& source, const std::string& text, const ClientProtocol::TagMap& tags, IRCv3::Batch::Batch* batch)
+    {
+        ClientProtocol::Messages::Privmsg privmsg(source, channel, text);
+        privmsg.AddTags(tags);
+        if (batch)
+            batch->AddToBatch(privmsg);
+        channel->Write(ServerInstance->GetRFCEvents().privmsg, privmsg);
+    }
+
 public:
     std::string fake_host;
     std::string fake_ident;
+    std::string linesep;
 
     CommandRelayMsg(Module* parent, RelayMsgCap& Cap, RelayMsgCapTag& Captag)
         : Command(parent, "RELAYMSG", 3, 3)
         , cap(Cap)
         , captag(Captag)
+        , batchmanager(parent)
+        , sourcecache(512)
     {
         flags_needed = 'o';
         syntax = "<channel> <nick> <text>";
         allow_empty_last_param = false;
     }
 
-    std::string GetFakeHostmask(const std::string& nick) {
-        return InspIRCd::Format("%s!%s@%s", nick.c_str(), fake_ident.c_str(), fake_host.c_str());
+    void ClearCache()
+    {
+        sourcecache.Clear();
     }
 
     CmdResult Handle(User* user, const CommandBase::Params& parameters)
@@ -144,13 +248,11 @@ public:
         }
 
         // Send the message to everyone in the channel
-        std::string fakeSource = GetFakeHostmask(nick);
-        ClientProtocol::Messages::Privmsg privmsg(fakeSource, channel, text);
         // Tag the message as @draft/relaymsg=<nick> so the sender can recognize it
         // Also copy over tags set on the original /relaymsg command
-        privmsg.AddTags(parameters.GetTags());
-        privmsg.AddTag("draft/relaymsg", &captag, user->nick);
-        channel->Write(ServerInstance->GetRFCEvents().privmsg, privmsg);
+        ClientProtocol::TagMap tags(parameters.GetTags());
+        tags.insert(std::make_pair("draft/relaymsg", ClientProtocol::MessageTagData(&captag, user->nick)));
+        SendLines(channel, sourcecache.Get(nick, fake_ident, fake_host), text, tags);
 
         if (IS_LOCAL(user))
         {
@@ -200,6 +302,8 @@ public:
         }
         cmd.fake_host = fake_host;
         cmd.fake_ident = fake_ident;
+        cmd.linesep = tag->getString("linesep");
+        cmd.ClearCache();
         cap.nick_separators = tag->getString("separators", "/", 1);
     }
 
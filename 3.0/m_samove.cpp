@@ -28,16 +28,142 @@
 /// $ModAuthorMail: torben@t-hoerup.dk
 /// $ModDepends: core 3
 /// $ModDesc: Adds /SAMOVE command to move a user from one channel to another (basically combining SAPART+SAJOIN)
+/// $ModConfig: <samove batchsize="50">
+//  If the nick given to SAMOVE is a wildcard mask (e.g. * or *!*@*.example.com) then every
+//  matching member of the from channel is moved. Each server moves its own users, at most
+//  "batchsize" of them per second.
 
 #include "inspircd.h"
 
+/** A pending move of every member of a channel that matches a mask.
+ */
+struct MassMove
+{
+	std::string source;
+	std::string mask;
+	std::string from_channel;
+	std::string to_channel;
+	size_t moved;
+
+	MassMove()
+		: moved(0)
+	{
+	}
+};
+
+/** Moves the users for mass moves a batch at a time.
+ */
+class MassMoveTimer : public Timer
+{
+ private:
+	std::list<MassMove> moves;
+
+	static bool MoveUser(LocalUser* user, Channel* from_chan, const std::string& to_channel)
+	{
+		std::string msg; //PartUser doesn't accept a const reference atm
+		from_chan->PartUser(user, msg);
+		return Channel::JoinUser(user, to_channel, true);
+	}
+
+	/** Moves up to batchsize users and returns true if the move is complete. */
+	bool Process(MassMove& move)
+	{
+		Channel* from_chan = ServerInstance->FindChan(move.from_channel);
+		if (!from_chan)
+			return true;
+
+		// Collect the users first as moving them modifies the member list.
+		std::vector<LocalUser*> users;
+		const Channel::MemberMap& members = from_chan->GetUsers();
+		for (Channel::MemberMap::const_iterator i = members.begin(); i != members.end() && users.size() <= batchsize; ++i)
+		{
+			LocalUser* user = IS_LOCAL(i->first);
+			if (!user || user->server->IsULine())
+				continue;
+
+			if (move.mask != "*" && !InspIRCd::Match(user->GetFullHost(), move.mask) && !InspIRCd::Match(user->GetFullRealHost(), move.mask))
+				continue;
+
+			users.push_back(user);
+		}
+
+		const bool complete = users.size() <= batchsize;
+		if (!complete)
+			users.pop_back();
+
+		for (std::vector<LocalUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+		{
+			if (MoveUser(*i, from_chan, move.to_channel))
+				move.moved++;
+
+			// Parting the last user destroys the channel.
+			from_chan = ServerInstance->FindChan(move.from_channel);
+			if (!from_chan)
+				return true;
+		}
+
+		if (!complete)
+		{
+			User* source = ServerInstance->FindUUID(move.source);
+			if (source)
+				source->WriteRemoteNotice(InspIRCd::Format("*** SAMOVE: Moved %lu users from %s to %s so far on %s",
+					static_cast<unsigned long>(move.moved), move.from_channel.c_str(), move.to_channel.c_str(),
+					ServerInstance->Config->ServerName.c_str()));
+		}
+		return complete;
+	}
+
+ public:
+	size_t batchsize;
+
+	MassMoveTimer()
+		: Timer(1, true)
+		, batchsize(50)
+	{
+	}
+
+	void Queue(const MassMove& move)
+	{
+		if (moves.empty())
+			ServerInstance->Timers.AddTimer(this);
+		moves.push_back(move);
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE
+	{
+		for (std::list<MassMove>::iterator move = moves.begin(); move != moves.end(); )
+		{
+			if (!Process(*move))
+			{
+				++move;
+				continue;
+			}
+
+			User* source = ServerInstance->FindUUID(move->source);
+			if (source)
+				source->WriteRemoteNotice(InspIRCd::Format("*** SAMOVE: Moved %lu users from %s to %s on %s",
+					static_cast<unsigned long>(move->moved), move->from_channel.c_str(), move->to_channel.c_str(),
+					ServerInstance->Config->ServerName.c_str()));
+			moves.erase(move++);
+		}
+		return !moves.empty();
+	}
+};
+
 /** Handle /SAMOVE
  *
  * Basically it's a SAPART + SAJOIN in 1 command
  */
 class CommandSamove : public Command
 {
+	static bool IsMask(const std::string& nickname)
+	{
+		return nickname.find_first_of("*?!@") != std::string::npos;
+	}
+
  public:
+	MassMoveTimer timer;
+
 	CommandSamove(Module* Creator) : Command(Creator,"SAMOVE", 1)
 	{
 		allow_empty_last_param = false;
@@ -57,6 +183,16 @@ class CommandSamove : public Command
 		const std::string& from_channel = parameters[1];
 		const std::string& to_channel = parameters[2];
 
+		// Moving users to the channel they are already in would just part and rejoin them.
+		if (irc::equals(from_channel, to_channel))
+		{
+			user->WriteRemoteNotice("*** 'from channel' and 'to channel' must be different");
+			return CMD_FAILURE;
+		}
+
+		if (IsMask(nickname))
+			return HandleMass(user, nickname, from_channel, to_channel);
+
 		User* dest = ServerInstance->FindNick(nickname);
 		if ((dest) && (dest->registered == REG_ALL))
 		{
@@ -140,8 +276,38 @@ class CommandSamove : public Command
 		}
 	}
 
+	CmdResult HandleMass(User* user, const std::string& mask, const std::string& from_channel, const std::string& to_channel)
+	{
+		if (!ServerInstance->FindChan(from_channel))
+		{
+			user->WriteRemoteNotice("*** invalid 'from channel' " + from_channel);
+			return CMD_FAILURE;
+		}
+		if (!ServerInstance->FindChan(to_channel))
+		{
+			user->WriteRemoteNotice("*** invalid 'to channel' " + to_channel);
+			return CMD_FAILURE;
+		}
+
+		/* Every server gets this command and moves its own users in batches, rather than
+		 * the source sending a separate SAMOVE for each user.
+		 */
+		MassMove move;
+		move.source = user->uuid;
+		move.mask = mask;
+		move.from_channel = from_channel;
+		move.to_channel = to_channel;
+		timer.Queue(move);
+
+		if (IS_LOCAL(user))
+			ServerInstance->SNO->WriteGlobalSno('m', user->nick+" used SAMOVE to move users matching "+mask+" from "+from_channel+" to "+to_channel);
+		return CMD_SUCCESS;
+	}
+
 	RouteDescriptor GetRouting(User* user, const Params& parameters) CXX11_OVERRIDE
 	{
+		if (parameters.size() == 3 && IsMask(parameters[0]))
+			return ROUTE_OPT_BCAST;
 		return ROUTE_OPT_UCAST(parameters[0]);
 	}
 };
@@ -160,6 +326,12 @@ class ModuleSamove : public Module
 		ServerInstance->SNO->EnableSnomask('m', "SAMOVE");
 	}
 
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("samove");
+		cmd.timer.batchsize = tag->getUInt("batchsize", 50, 1);
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Adds the /SAMOVE command which allows server operators to force move users from one channel to another.", VF_OPTCOMMON);
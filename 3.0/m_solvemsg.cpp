@@ -18,7 +18,7 @@
 
 /// $ModAuthor: Sadie Powell
 /// $ModAuthorMail: sadie@witchery.services
-/// $ModConfig: <solvemsg chanmsg="no" usermsg="yes">
+/// $ModConfig: <solvemsg chanmsg="no" usermsg="yes" cachetime="10m">
 /// $ModDepends: core 3
 /// $ModDesc: Requires users to solve a basic maths problem before messaging others.
 
@@ -33,15 +33,83 @@ struct Problem
 	time_t nextwarning;
 };
 
+// Remembers the IP addresses and accounts of users who have recently solved a problem.
+class SolvedCache
+{
+ private:
+	typedef std::map<std::string, time_t> ExpiryMap;
+
+	ExpiryMap ips;
+	ExpiryMap accounts;
+
+	static const std::string* GetAccount(LocalUser* user)
+	{
+		const AccountExtItem* accextitem = GetAccountExtItem();
+		return accextitem ? accextitem->get(user) : NULL;
+	}
+
+	static void Expire(ExpiryMap& entries, time_t now)
+	{
+		for (ExpiryMap::iterator iter = entries.begin(); iter != entries.end(); )
+		{
+			if (iter->second <= now)
+				entries.erase(iter++);
+			else
+				++iter;
+		}
+	}
+
+	static bool Check(const ExpiryMap& entries, const std::string& key)
+	{
+		ExpiryMap::const_iterator iter = entries.find(key);
+		return iter != entries.end() && iter->second > ServerInstance->Time();
+	}
+
+ public:
+	time_t duration;
+
+	void Add(LocalUser* user)
+	{
+		if (!duration)
+			return;
+
+		const time_t expiry = ServerInstance->Time() + duration;
+		ips[user->GetIPString()] = expiry;
+
+		const std::string* account = GetAccount(user);
+		if (account)
+			accounts[*account] = expiry;
+	}
+
+	bool Check(LocalUser* user) const
+	{
+		if (Check(ips, user->GetIPString()))
+			return true;
+
+		const std::string* account = GetAccount(user);
+		return account && Check(accounts, *account);
+	}
+
+	void Expire(time_t now)
+	{
+		Expire(ips, now);
+		Expire(accounts, now);
+	}
+};
+
 class CommandSolve : public SplitCommand
 {
  private:
 	SimpleExtItem<Problem>& ext;
+	LocalIntExt& solved;
+	SolvedCache& cache;
 
  public:
-	CommandSolve(Module* Creator, SimpleExtItem<Problem>& Ext)
+	CommandSolve(Module* Creator, SimpleExtItem<Problem>& Ext, LocalIntExt& Solved, SolvedCache& Cache)
 		: SplitCommand(Creator, "SOLVE", 1, 1)
 		, ext(Ext)
+		, solved(Solved)
+		, cache(Cache)
 	{
 	}
 
@@ -50,7 +118,10 @@ class CommandSolve : public SplitCommand
 		Problem* problem = ext.get(user);
 		if (!problem)
 		{
-			user->WriteNotice("** You have already solved your problem!");
+			if (solved.get(user))
+				user->WriteNotice("** You have already solved your problem!");
+			else
+				user->WriteNotice("** You have not been given a problem to solve!");
 			return CMD_FAILURE;
 		}
 
@@ -63,6 +134,8 @@ class CommandSolve : public SplitCommand
 		}
 
 		ext.unset(user);
+		solved.set(user, 1);
+		cache.Add(user);
 		user->WriteNotice(InspIRCd::Format("*** %s is the correct answer!", parameters[0].c_str()));
 		return CMD_SUCCESS;
 	}
@@ -72,6 +145,8 @@ class ModuleSolveMessage : public Module
 {
  private:
 	SimpleExtItem<Problem> ext;
+	LocalIntExt solved;
+	SolvedCache cache;
 	CommandSolve cmd;
 	bool chanmsg;
 	bool usermsg;
@@ -81,8 +156,21 @@ class ModuleSolveMessage : public Module
  public:
 	ModuleSolveMessage()
 		: ext("solve-message", ExtensionItem::EXT_USER, this)
-		, cmd(this, ext)
+		, solved("solve-message-solved", ExtensionItem::EXT_USER, this)
+		, cmd(this, ext, solved, cache)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
 	{
+		// Users who were already connected when the module was loaded don't need to solve a problem.
+		const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator iter = list.begin(); iter != list.end(); ++iter)
+		{
+			LocalUser* user = *iter;
+			if (user->registered == REG_ALL)
+				solved.set(user, 1);
+		}
 	}
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
@@ -92,15 +180,12 @@ class ModuleSolveMessage : public Module
 		usermsg = tag->getBool("usermsg", true);
 		exemptregistered = tag->getBool("exemptregistered", true);
 		warntime = tag->getDuration("warntime", 60, 1);
+		cache.duration = tag->getDuration("cachetime", 10*60);
 	}
 
-	void OnUserPostInit(LocalUser* user) CXX11_OVERRIDE
+	void OnBackgroundTimer(time_t curtime) CXX11_OVERRIDE
 	{
-		Problem problem;
-		problem.first = ServerInstance->GenRandomInt(9);
-		problem.second = ServerInstance->GenRandomInt(9);
-		problem.nextwarning = 0;
-		ext.set(user, problem);
+		cache.Expire(curtime);
 	}
 
 	ModResult OnUserPreMessage(User* user, const MessageTarget& msgtarget, MessageDetails& details) CXX11_OVERRIDE
@@ -149,10 +234,28 @@ class ModuleSolveMessage : public Module
 				return MOD_RES_PASSTHRU; // Only opers can do this.
 		}
 
-		Problem* problem = ext.get(user);
-		if (!problem)
+		if (solved.get(source))
 			return MOD_RES_PASSTHRU;
 
+		Problem* problem = ext.get(source);
+		if (!problem)
+		{
+			// Users who recently solved a problem from the same IP or account don't need to again.
+			if (cache.Check(source))
+			{
+				solved.set(source, 1);
+				return MOD_RES_PASSTHRU;
+			}
+
+			// Only generate a problem for users who actually try to message someone.
+			Problem newproblem;
+			newproblem.first = ServerInstance->GenRandomInt(9);
+			newproblem.second = ServerInstance->GenRandomInt(9);
+			newproblem.nextwarning = 0;
+			ext.set(source, newproblem);
+			problem = ext.get(source);
+		}
+
 		if (problem->nextwarning > ServerInstance->Time())
 			return MOD_RES_DENY;
 
@@ -31,22 +31,76 @@
 #include "modules/account.h"
 #include "modules/ctctags.h"
 
+typedef insp::flat_set<std::string, irc::insensitive_swo> AccountList;
+
 class TagIPHost : public ClientProtocol::MessageTagProvider
 {
  private:
 	CTCTags::CapReference ctctagcap;
 
+	// Whether a local user is privileged enough to receive the tags.
+	LocalIntExt eligible;
+
+	// The number of local users who are privileged enough to receive the tags.
+	size_t eligiblecount;
+
  public:
-	std::vector<std::string> accounts;
+	AccountList accounts;
 
 	TagIPHost(Module* mod)
 		: ClientProtocol::MessageTagProvider(mod)
 		, ctctagcap(mod)
+		, eligible("iphost-eligible", ExtensionItem::EXT_USER, mod)
+		, eligiblecount(0)
+	{
+	}
+
+	bool IsEligible(LocalUser* user, const std::string* account)
+	{
+		if (user->HasPrivPermission("users/iphost"))
+			return true;
+
+		return account && accounts.count(*account);
+	}
+
+	void Recheck(LocalUser* user, const std::string* account)
+	{
+		const bool waseligible = eligible.get(user);
+		const bool iseligible = IsEligible(user, account);
+		if (waseligible == iseligible)
+			return;
+
+		if (iseligible)
+		{
+			eligible.set(user, 1);
+			eligiblecount++;
+		}
+		else
+		{
+			eligible.unset(user);
+			eligiblecount--;
+		}
+	}
+
+	void Recheck(LocalUser* user)
 	{
+		const AccountExtItem* accountext = GetAccountExtItem();
+		Recheck(user, accountext ? accountext->get(user) : NULL);
+	}
+
+	void Forget(LocalUser* user)
+	{
+		if (eligible.get(user))
+			eligiblecount--;
+		eligible.unset(user);
 	}
 
 	void OnPopulateTags(ClientProtocol::Message& msg) CXX11_OVERRIDE
 	{
+		// Nobody on this server can see the tags so don't bother adding them.
+		if (!eligiblecount)
+			return;
+
 		User* const user = msg.GetSourceUser();
 		if (user && !IS_SERVER(user) && !user->server->IsULine())
 		{
@@ -63,53 +117,74 @@ class TagIPHost : public ClientProtocol::MessageTagProvider
 
 	bool ShouldSendTag(LocalUser* user, const ClientProtocol::MessageTagData&) CXX11_OVERRIDE
 	{
-		if (!ctctagcap.get(user))
-			return false;
-
-		if (user->HasPrivPermission("users/iphost"))
-			return true;
-
-		if (accounts.empty())
-			return false;
-
-		const AccountExtItem* accountext = GetAccountExtItem();
-		const std::string* account = accountext ? accountext->get(user) : NULL;
-		if (!account)
-			return false;
-
-		for (std::vector<std::string>::const_iterator i = accounts.begin(); i != accounts.end(); ++i)
-		{
-			if (irc::equals(*account, *i))
-				return true;
-		}
-
-		return false;
+		return eligible.get(user) && ctctagcap.get(user);
 	}
 };
 
-class ModuleTagIPHost : public Module
+class ModuleTagIPHost
+	: public Module
+	, public AccountEventListener
 {
  private:
 	TagIPHost iphost;
 
  public:
 	ModuleTagIPHost()
-		: iphost(this)
+		: AccountEventListener(this)
+		, iphost(this)
 	{
 	}
 
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
-		std::vector<std::string> newaccounts;
+		AccountList newaccounts;
 
 		ConfigTag* tag = ServerInstance->Config->ConfValue("iphost");
 		const std::string accounts = tag->getString("accounts");
 
 		irc::spacesepstream ss(accounts);
 		for (std::string token; ss.GetToken(token); )
-			newaccounts.push_back(token);
+			newaccounts.insert(token);
 
 		iphost.accounts.swap(newaccounts);
+
+		// Oper privileges and the account list may have changed.
+		const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
+		for (UserManager::LocalList::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+			iphost.Recheck(*iter);
+	}
+
+	void OnAccountChange(User* user, const std::string& newaccount) CXX11_OVERRIDE
+	{
+		LocalUser* const luser = IS_LOCAL(user);
+		if (luser)
+			iphost.Recheck(luser, newaccount.empty() ? NULL : &newaccount);
+	}
+
+	void OnPostOper(User* user, const std::string&, const std::string&) CXX11_OVERRIDE
+	{
+		LocalUser* const luser = IS_LOCAL(user);
+		if (luser)
+			iphost.Recheck(luser);
+	}
+
+	void OnPostDeoper(User* user) CXX11_OVERRIDE
+	{
+		LocalUser* const luser = IS_LOCAL(user);
+		if (luser)
+			iphost.Recheck(luser);
+	}
+
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		LocalUser* const luser = IS_LOCAL(user);
+		if (luser)
+			iphost.Recheck(luser);
+	}
+
+	void OnUserDisconnect(LocalUser* user) CXX11_OVERRIDE
+	{
+		iphost.Forget(user);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
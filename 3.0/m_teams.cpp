@@ -20,6 +20,7 @@
 /// $ModAuthorMail: sadie@witchery.services
 /// $ModDepends: core 3
 /// $ModDesc: Allows users to be managed using services-assigned teams.
+// Opers need the users/team-message privilege to message or WHO a team they are not a member of.
 
 
 #include "inspircd.h"
@@ -27,6 +28,10 @@
 
 enum
 {
+	// From RFC 1459.
+	RPL_ENDOFWHO = 315,
+	RPL_WHOREPLY = 352,
+
 	// InspIRCd specific.
 	RPL_WHOISTEAMS = 695
 };
@@ -34,14 +39,104 @@ enum
 // Represents a list of teams that a user is a member of.
 typedef insp::flat_set<std::string, irc::insensitive_swo> TeamList;
 
+// Represents the users who are a member of a team.
+typedef std::set<User*> TeamMembers;
+
+// Maps team names to the users who are a member of them.
+typedef std::map<std::string, TeamMembers, irc::insensitive_swo> TeamIndex;
+
+// Maps team names to a small integer which identifies them.
+typedef insp::flat_map<std::string, size_t, irc::insensitive_swo> TeamIdMap;
+
+// Represents the sorted identifiers of the teams that a user is a member of.
+typedef std::vector<size_t> TeamIdList;
+
+// Maps t: ban masks to the identifier of the team they match.
+typedef insp::flat_map<std::string, size_t, irc::insensitive_swo> TeamBanMap;
+
 class TeamExt : public SimpleExtItem<TeamList>
 {
+ private:
+	TeamIndex index;
+	TeamIdMap ids;
+	SimpleExtItem<TeamIdList> idext;
+
+	void AddMember(User* user, const TeamList& teams)
+	{
+		TeamIdList* teamids = new TeamIdList();
+		teamids->reserve(teams.size());
+		for (TeamList::const_iterator iter = teams.begin(); iter != teams.end(); ++iter)
+		{
+			index[*iter].insert(user);
+			teamids->push_back(GetId(*iter));
+		}
+		std::sort(teamids->begin(), teamids->end());
+		idext.set(user, teamids);
+	}
+
+	void RemoveMember(User* user, const TeamList& teams)
+	{
+		idext.unset(user);
+		for (TeamList::const_iterator iter = teams.begin(); iter != teams.end(); ++iter)
+		{
+			TeamIndex::iterator team = index.find(*iter);
+			if (team == index.end())
+				continue;
+
+			team->second.erase(user);
+			if (team->second.empty())
+				index.erase(team);
+		}
+	}
+
  public:
 	TeamExt(Module* Creator)
 		: SimpleExtItem<TeamList>("teams", ExtensionItem::EXT_USER, Creator)
+		, idext("team-ids", ExtensionItem::EXT_USER, Creator)
 	{
 	}
 
+	size_t GetId(const std::string& team)
+	{
+		// Team identifiers are never reused so there's no need to free them.
+		TeamIdMap::iterator iter = ids.find(team);
+		if (iter == ids.end())
+			iter = ids.insert(std::make_pair(team, ids.size())).first;
+		return iter->second;
+	}
+
+	bool FindId(const std::string& team, size_t& id) const
+	{
+		TeamIdMap::const_iterator iter = ids.find(team);
+		if (iter == ids.end())
+			return false;
+
+		id = iter->second;
+		return true;
+	}
+
+	bool IsMember(User* user, size_t id)
+	{
+		TeamIdList* teamids = idext.get(user);
+		return teamids && std::binary_search(teamids->begin(), teamids->end(), id);
+	}
+
+	const TeamMembers* GetMembers(const std::string& team) const
+	{
+		TeamIndex::const_iterator iter = index.find(team);
+		return iter == index.end() ? NULL : &iter->second;
+	}
+
+	void Forget(User* user)
+	{
+		TeamList* teams = get(user);
+		if (!teams)
+			return;
+
+		RemoveMember(user, *teams);
+		unset(user);
+	}
+
 	std::string ToNetwork(const Extensible* container, void* item) const CXX11_OVERRIDE
 	{
 		TeamList* teamlist = static_cast<TeamList*>(item);
@@ -50,6 +145,10 @@ class TeamExt : public SimpleExtItem<TeamList>
 
 	void FromNetwork(Extensible* container, const std::string& value) CXX11_OVERRIDE
 	{
+		// Remove the user from the index of their old teams.
+		User* user = static_cast<User*>(container);
+		Forget(user);
+
 		// Create a new team list from the input.
 		TeamList* newteamlist = new TeamList();
 		irc::spacesepstream teamstream(value);
@@ -58,18 +157,175 @@ class TeamExt : public SimpleExtItem<TeamList>
 
 		if (newteamlist->empty())
 		{
-			// If the new team list is empty then delete both the new and old team lists.
-			unset(container);
+			// If the new team list is empty then delete it.
 			delete newteamlist;
 		}
 		else
 		{
 			// Otherwise install the new team list.
 			set(container, newteamlist);
+			AddMember(user, *newteamlist);
 		}
 	}
 };
 
+// The details of a message sent to a team.
+class TeamMessageDetails : public MessageDetails
+{
+ public:
+	TeamMessageDetails(MessageType mt, const std::string& msg, const ClientProtocol::TagMap& tags)
+		: MessageDetails(mt, msg, tags)
+	{
+	}
+
+	bool IsCTCP(std::string& name, std::string& body) const CXX11_OVERRIDE
+	{
+		if (!IsCTCP(name))
+			return false;
+
+		size_t end_of_name = text.find(' ', 2);
+		size_t start_of_body = end_of_name == std::string::npos ? std::string::npos : text.find_first_not_of(' ', end_of_name + 1);
+		if (start_of_body == std::string::npos)
+		{
+			body.clear();
+			return true;
+		}
+
+		size_t end_of_ctcp = *text.rbegin() == '\x1' ? 1 : 0;
+		body.assign(text, start_of_body, text.length() - start_of_body - end_of_ctcp);
+		return true;
+	}
+
+	bool IsCTCP(std::string& name) const CXX11_OVERRIDE
+	{
+		if (!IsCTCP())
+			return false;
+
+		size_t end_of_name = text.find(' ', 2);
+		if (end_of_name == std::string::npos)
+		{
+			size_t end_of_ctcp = *text.rbegin() == '\x1' ? 1 : 0;
+			name.assign(text, 1, text.length() - 1 - end_of_ctcp);
+			return true;
+		}
+
+		name.assign(text, 1, end_of_name - 1);
+		return true;
+	}
+
+	bool IsCTCP() const CXX11_OVERRIDE
+	{
+		return (text.length() >= 2) && (text[0] == '\x1') && (text[1] != '\x1') && (text[1] != ' ');
+	}
+};
+
+// Delivers team messages to the local members of a team. Servers send this to each
+// other so that a team message is only routed once per server.
+class CommandTeamMsg : public Command
+{
+ private:
+	TeamExt& ext;
+
+ public:
+	std::string teamchar;
+
+	CommandTeamMsg(Module* Creator, TeamExt& Ext)
+		: Command(Creator, "TEAMMSG", 3, 3)
+		, ext(Ext)
+	{
+		flags_needed = FLAG_SERVERONLY;
+	}
+
+	// Runs the message events and sends the message to the local members of the team.
+	// Returns false if a module blocked the message. On success text is updated with
+	// the text that was actually sent.
+	bool Deliver(User* source, const std::string& team, std::string& text, MessageType mt, const ClientProtocol::TagMap& tags)
+	{
+		const std::string target = teamchar + team;
+		MessageTarget msgtarget(&target);
+		TeamMessageDetails msgdetails(mt, text, tags);
+
+		ModResult modres;
+		FIRST_MOD_RESULT(OnUserPreMessage, modres, (source, msgtarget, msgdetails));
+		if (modres == MOD_RES_DENY)
+		{
+			FOREACH_MOD(OnUserMessageBlocked, (source, msgtarget, msgdetails));
+			return false;
+		}
+
+		FOREACH_MOD(OnUserMessage, (source, msgtarget, msgdetails));
+
+		const TeamMembers* members = ext.GetMembers(team);
+		if (members)
+		{
+			// The message is only serialised once for all of the recipients.
+			ClientProtocol::Messages::Privmsg msg(ClientProtocol::Messages::Privmsg::nocopy, source, target, msgdetails.text, mt);
+			msg.AddTags(msgdetails.tags_out);
+			msg.SetSideEffect(true);
+			for (TeamMembers::const_iterator iter = members->begin(); iter != members->end(); ++iter)
+			{
+				LocalUser* member = IS_LOCAL(*iter);
+				if (!member || member == source || member->registered != REG_ALL)
+					continue;
+
+				if (msgdetails.exemptions.count(member))
+					continue;
+
+				member->Send(ServerInstance->GetRFCEvents().privmsg, msg);
+			}
+		}
+
+		FOREACH_MOD(OnUserPostMessage, (source, msgtarget, msgdetails));
+		text = msgdetails.text;
+		return true;
+	}
+
+	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE
+	{
+		// This is only sent by servers on behalf of remote users.
+		std::string text(parameters[2]);
+		Deliver(user, parameters[0], text, parameters[1] == "NOTICE" ? MSG_NOTICE : MSG_PRIVMSG, parameters.GetTags());
+		return CMD_SUCCESS;
+	}
+};
+
+// Resolves t: bans to a team identifier when they are set.
+class TeamBanWatcher : public ModeWatcher
+{
+ private:
+	TeamExt& ext;
+
+ public:
+	TeamBanMap bans;
+
+	TeamBanWatcher(Module* Creator, TeamExt& Ext)
+		: ModeWatcher(Creator, "ban", MODETYPE_CHANNEL)
+		, ext(Ext)
+	{
+	}
+
+	void AfterMode(User* source, User* dest, Channel* channel, const std::string& parameter, bool adding) CXX11_OVERRIDE
+	{
+		if (parameter.length() <= 2 || parameter[0] != 't' || parameter[1] != ':')
+			return;
+
+		if (!adding)
+		{
+			bans.erase(parameter);
+			return;
+		}
+
+		// Wildcard masks still need to be matched against every team.
+		if (parameter.find_first_of("*?", 2) != std::string::npos)
+			return;
+
+		// Bans on teams which don't exist yet are left to the string match.
+		size_t id;
+		if (ext.FindId(parameter.substr(2), id))
+			bans[parameter] = id;
+	}
+};
+
 class ModuleTeams
 	: public Module
 	, public Whois::EventListener
@@ -77,32 +333,41 @@ class ModuleTeams
  private:
 	bool active;
 	TeamExt ext;
+	CommandTeamMsg teammsg;
+	TeamBanWatcher banwatcher;
 	std::string teamchar;
 
 	size_t ExecuteCommand(LocalUser* source, const char* cmd, CommandBase::Params& parameters,
 		const std::string& team, size_t nickindex)
 	{
-		size_t targets = 0;
+		const TeamMembers* members = ext.GetMembers(team);
+		if (!members)
+			return 0;
+
+		// Look up the handler once rather than dispatching a new command for every member.
 		std::string command(cmd);
-		const user_hash& users = ServerInstance->Users->GetUsers();
-		for (user_hash::const_iterator iter = users.begin(); iter != users.end(); ++iter)
+		Command* handler = ServerInstance->Parser.GetHandler(command);
+		if (!handler)
+			return 0;
+
+		// Copy the member list as the command handler may cause it to change.
+		size_t targets = 0;
+		const std::vector<User*> users(members->begin(), members->end());
+		for (std::vector<User*>::const_iterator iter = users.begin(); iter != users.end(); ++iter)
 		{
-			User* user = iter->second;
-			if (user->registered != REG_ALL)
-				continue;
-	
-			TeamList* teams = ext.get(user);
-			if (!teams || teams->count(team))
+			User* user = *iter;
+			if (user->registered != REG_ALL || user->quitting)
 				continue;
 
 			parameters[nickindex] = user->nick;
 			ModResult modres;
 			FIRST_MOD_RESULT(OnPreCommand, modres, (command, parameters, source, true));
-			if (modres != MOD_RES_DENY)
-			{
-				ServerInstance->Parser.CallHandler(command, parameters, source);
-				targets++;
-			}
+			if (modres == MOD_RES_DENY)
+				continue;
+
+			CmdResult result = handler->Handle(source, parameters);
+			FOREACH_MOD(OnPostCommand, (handler, parameters, source, result, true));
+			targets++;
 		}
 		return targets;
 	}
@@ -112,7 +377,7 @@ class ModuleTeams
 		if (param.length() <= teamchar.length() || param.compare(0, teamchar.length(), teamchar) != 0)
 			return false;
 
-		team.assign(param, teamchar.length() - 1, std::string::npos);
+		team.assign(param, teamchar.length(), std::string::npos);
 		return true;
 	}
 
@@ -130,11 +395,76 @@ class ModuleTeams
 		return MOD_RES_DENY;
 	}
 
+	ModResult HandleMessage(LocalUser* source, CommandBase::Params& parameters, MessageType mt)
+	{
+		std::string team;
+		if (parameters.size() < 2 || !IsTeam(parameters[0], team))
+			return MOD_RES_PASSTHRU;
+
+		std::string text(parameters[1]);
+		if (text.empty())
+		{
+			source->WriteNumeric(ERR_NOTEXTTOSEND, "No text to send");
+			return MOD_RES_DENY;
+		}
+
+		TeamList* teams = ext.get(source);
+		if ((!teams || !teams->count(team)) && !source->HasPrivPermission("users/team-message"))
+		{
+			source->WriteNumeric(ERR_CANNOTSENDTOCHAN, parameters[0], "You must be a member of this team to message it");
+			return MOD_RES_DENY;
+		}
+
+		if (!teammsg.Deliver(source, team, text, mt, parameters.GetTags()))
+			return MOD_RES_DENY;
+
+		CommandBase::Params params;
+		params.push_back(team);
+		params.push_back(mt == MSG_NOTICE ? "NOTICE" : "PRIVMSG");
+		params.push_back(":" + text);
+		ServerInstance->PI->BroadcastEncap("TEAMMSG", params, source);
+		return MOD_RES_DENY;
+	}
+
+	ModResult HandleWho(LocalUser* source, CommandBase::Params& parameters)
+	{
+		std::string team;
+		if (parameters.empty() || !IsTeam(parameters[0], team))
+			return MOD_RES_PASSTHRU;
+
+		// Only members of the team and privileged opers can list its members.
+		TeamList* teams = ext.get(source);
+		const bool canlist = (teams && teams->count(team)) || source->HasPrivPermission("users/team-message");
+
+		const TeamMembers* members = canlist ? ext.GetMembers(team) : NULL;
+		if (members)
+		{
+			for (TeamMembers::const_iterator iter = members->begin(); iter != members->end(); ++iter)
+			{
+				User* user = *iter;
+				if (user->registered != REG_ALL)
+					continue;
+
+				std::string flags(user->IsAway() ? "G" : "H");
+				if (user->IsOper())
+					flags.push_back('*');
+
+				source->WriteNumeric(RPL_WHOREPLY, "*", user->ident, user->GetDisplayedHost(), user->server->GetName(),
+					user->nick, flags, "0 " + user->GetRealName());
+			}
+		}
+
+		source->WriteNumeric(RPL_ENDOFWHO, parameters[0], "End of /WHO list.");
+		return MOD_RES_DENY;
+	}
+
  public:
 	ModuleTeams()
 		: Whois::EventListener(this)
 		, active(false)
 		, ext(this)
+		, teammsg(this, ext)
+		, banwatcher(this, ext)
 	{
 	}
 
@@ -142,6 +472,7 @@ class ModuleTeams
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("teams");
 		teamchar = tag->getString("prefix", "^", 1);
+		teammsg.teamchar = teamchar;
 	}
 
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
@@ -158,6 +489,11 @@ class ModuleTeams
 		if (!teams)
 			return MOD_RES_PASSTHRU;
 
+		// If the ban was resolved when it was set we can just compare identifiers.
+		TeamBanMap::const_iterator ban = banwatcher.bans.find(mask);
+		if (ban != banwatcher.bans.end())
+			return ext.IsMember(user, ban->second) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
+
 		const std::string submask = mask.substr(2);
 		for (TeamList::const_iterator iter = teams->begin(); iter != teams->end(); ++iter)
 		{
@@ -176,9 +512,23 @@ class ModuleTeams
 		if (command == "INVITE")
 			return HandleInvite(user, parameters);
 
+		if (command == "PRIVMSG")
+			return HandleMessage(user, parameters, MSG_PRIVMSG);
+
+		if (command == "NOTICE")
+			return HandleMessage(user, parameters, MSG_NOTICE);
+
+		if (command == "WHO")
+			return HandleWho(user, parameters);
+
 		return MOD_RES_PASSTHRU;
 	}
 
+	void OnUserQuit(User* user, const std::string& message, const std::string& opermessage) CXX11_OVERRIDE
+	{
+		ext.Forget(user);
+	}
+
 	void OnWhois(Whois::Context& whois) CXX11_OVERRIDE
 	{
 		TeamList* teams = ext.get(whois.GetTarget());